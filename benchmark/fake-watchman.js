@@ -0,0 +1,785 @@
+// A stand-in for the watchman daemon, used to benchmark the watchman backend
+// without a real watchman. It speaks BSER over a unix socket (or a named pipe
+// on Windows), and answers the commands the backend sends. Subscriptions are
+// sent a synthetic or recorded stream of changes at a controlled rate.
+//
+// Point the backend at it by setting WATCHMAN_SOCK to its socket path.
+//
+//   node benchmark/fake-watchman.js --sock /tmp/watchman.sock --files 10000 --batch 100 --rate 20
+//   node benchmark/fake-watchman.js --sock /tmp/watchman.sock --replay recording.jsonl
+//
+// Tests use it to send specific records with push(), and malformed data with
+// writeRaw(), to subscriptions.
+//
+// Recordings have one PDU per line, in the format printed by
+// `watchman -j -p --no-pretty` for a subscription, so they can be captured
+// from a real watchman. A line may have a `delay` in milliseconds to wait
+// before sending it, otherwise PDUs are sent at `rate` per second.
+
+const net = require('net');
+const fs = require('fs');
+const path = require('path');
+const {EventEmitter} = require('events');
+const picomatch = require('picomatch');
+
+const BSER_ARRAY = 0x00;
+const BSER_OBJECT = 0x01;
+const BSER_STRING = 0x02;
+const BSER_INT8 = 0x03;
+const BSER_INT16 = 0x04;
+const BSER_INT32 = 0x05;
+const BSER_INT64 = 0x06;
+const BSER_REAL = 0x07;
+const BSER_BOOL_TRUE = 0x08;
+const BSER_BOOL_FALSE = 0x09;
+const BSER_NULL = 0x0a;
+const BSER_TEMPLATE = 0x0b;
+const BSER_SKIP = 0x0c;
+
+// Arrays of objects wrapped with template() are encoded as BSER templates,
+// like watchman does for the files of large responses.
+class Template {
+  constructor(rows) {
+    this.rows = rows;
+  }
+}
+
+function template(rows) {
+  return new Template(rows);
+}
+
+class Writer {
+  constructor(size = 64 * 1024) {
+    this.buffer = Buffer.allocUnsafe(size);
+    this.length = 0;
+  }
+
+  reserve(size) {
+    if (this.length + size > this.buffer.length) {
+      let buffer = Buffer.allocUnsafe(
+        Math.max(this.buffer.length * 2, this.length + size),
+      );
+      this.buffer.copy(buffer, 0, 0, this.length);
+      this.buffer = buffer;
+    }
+  }
+
+  byte(value) {
+    this.reserve(1);
+    this.buffer[this.length++] = value;
+  }
+
+  int(value) {
+    if (typeof value === 'bigint') {
+      this.reserve(9);
+      this.buffer[this.length++] = BSER_INT64;
+      this.buffer.writeBigInt64LE(value, this.length);
+      this.length += 8;
+    } else if (value >= -0x80 && value <= 0x7f) {
+      this.reserve(2);
+      this.buffer[this.length++] = BSER_INT8;
+      this.buffer.writeInt8(value, this.length);
+      this.length += 1;
+    } else if (value >= -0x8000 && value <= 0x7fff) {
+      this.reserve(3);
+      this.buffer[this.length++] = BSER_INT16;
+      this.buffer.writeInt16LE(value, this.length);
+      this.length += 2;
+    } else if (value >= -0x80000000 && value <= 0x7fffffff) {
+      this.reserve(5);
+      this.buffer[this.length++] = BSER_INT32;
+      this.buffer.writeInt32LE(value, this.length);
+      this.length += 4;
+    } else {
+      this.int(BigInt(value));
+    }
+  }
+
+  string(value) {
+    let length = Buffer.byteLength(value);
+    this.int(length);
+    this.reserve(length);
+    this.buffer.write(value, this.length);
+    this.length += length;
+  }
+
+  value(value) {
+    if (value === null || value === undefined) {
+      this.byte(BSER_NULL);
+    } else if (value === true) {
+      this.byte(BSER_BOOL_TRUE);
+    } else if (value === false) {
+      this.byte(BSER_BOOL_FALSE);
+    } else if (typeof value === 'bigint') {
+      this.int(value);
+    } else if (typeof value === 'number') {
+      if (Number.isInteger(value)) {
+        this.int(value);
+      } else {
+        this.reserve(9);
+        this.buffer[this.length++] = BSER_REAL;
+        this.buffer.writeDoubleLE(value, this.length);
+        this.length += 8;
+      }
+    } else if (typeof value === 'string') {
+      this.byte(BSER_STRING);
+      this.string(value);
+    } else if (Array.isArray(value)) {
+      this.byte(BSER_ARRAY);
+      this.int(value.length);
+      for (let item of value) {
+        this.value(item);
+      }
+    } else if (value instanceof Template) {
+      let keys = [...new Set(value.rows.flatMap((row) => Object.keys(row)))];
+      this.byte(BSER_TEMPLATE);
+      this.value(keys);
+      this.int(value.rows.length);
+      for (let row of value.rows) {
+        for (let key of keys) {
+          if (key in row) {
+            this.value(row[key]);
+          } else {
+            this.byte(BSER_SKIP);
+          }
+        }
+      }
+    } else {
+      let keys = Object.keys(value);
+      this.byte(BSER_OBJECT);
+      this.int(keys.length);
+      for (let key of keys) {
+        this.byte(BSER_STRING);
+        this.string(key);
+        this.value(value[key]);
+      }
+    }
+  }
+}
+
+// Encodes a PDU. The header always uses a 32-bit length so it can be written
+// after the body.
+function encode(value) {
+  let writer = new Writer();
+  writer.reserve(7);
+  writer.length = 7;
+  writer.value(value);
+  writer.buffer[0] = 0x00;
+  writer.buffer[1] = 0x01;
+  writer.buffer[2] = BSER_INT32;
+  writer.buffer.writeInt32LE(writer.length - 7, 3);
+  return writer.buffer.subarray(0, writer.length);
+}
+
+class Reader {
+  constructor(buffer, offset = 0) {
+    this.buffer = buffer;
+    this.offset = offset;
+  }
+
+  int() {
+    let type = this.buffer[this.offset++];
+    let value;
+    switch (type) {
+      case BSER_INT8:
+        value = this.buffer.readInt8(this.offset);
+        this.offset += 1;
+        break;
+      case BSER_INT16:
+        value = this.buffer.readInt16LE(this.offset);
+        this.offset += 2;
+        break;
+      case BSER_INT32:
+        value = this.buffer.readInt32LE(this.offset);
+        this.offset += 4;
+        break;
+      case BSER_INT64:
+        value = Number(this.buffer.readBigInt64LE(this.offset));
+        this.offset += 8;
+        break;
+      default:
+        throw new Error(`Expected an integer, got type ${type}`);
+    }
+    return value;
+  }
+
+  string() {
+    let length = this.int();
+    let value = this.buffer.toString('utf8', this.offset, this.offset + length);
+    this.offset += length;
+    return value;
+  }
+
+  value() {
+    let type = this.buffer[this.offset];
+    switch (type) {
+      case BSER_ARRAY: {
+        this.offset++;
+        let length = this.int();
+        let value = [];
+        for (let i = 0; i < length; i++) {
+          value.push(this.value());
+        }
+        return value;
+      }
+      case BSER_OBJECT: {
+        this.offset++;
+        let length = this.int();
+        let value = {};
+        for (let i = 0; i < length; i++) {
+          this.offset++;
+          let key = this.string();
+          value[key] = this.value();
+        }
+        return value;
+      }
+      case BSER_STRING:
+        this.offset++;
+        return this.string();
+      case BSER_INT8:
+      case BSER_INT16:
+      case BSER_INT32:
+      case BSER_INT64:
+        return this.int();
+      case BSER_REAL: {
+        let value = this.buffer.readDoubleLE(this.offset + 1);
+        this.offset += 9;
+        return value;
+      }
+      case BSER_BOOL_TRUE:
+      case BSER_BOOL_FALSE:
+      case BSER_NULL:
+        this.offset++;
+        return type === BSER_NULL ? null : type === BSER_BOOL_TRUE;
+      case BSER_TEMPLATE: {
+        this.offset++;
+        let keys = this.value();
+        let length = this.int();
+        let rows = [];
+        for (let i = 0; i < length; i++) {
+          let row = {};
+          for (let key of keys) {
+            if (this.buffer[this.offset] === BSER_SKIP) {
+              this.offset++;
+            } else {
+              row[key] = this.value();
+            }
+          }
+          rows.push(row);
+        }
+        return rows;
+      }
+      default:
+        throw new Error(`Unknown BSER type ${type}`);
+    }
+  }
+}
+
+// Decodes the first PDU in the buffer. Returns null if it is incomplete,
+// otherwise the value and the number of bytes it used.
+function decode(buffer) {
+  if (buffer.length < 3 || buffer.length < 3 + intSize(buffer[2])) {
+    return null;
+  }
+
+  let reader = new Reader(buffer, 2);
+  let length = reader.int();
+  if (buffer.length < reader.offset + length) {
+    return null;
+  }
+
+  return {value: reader.value(), length: reader.offset};
+}
+
+function intSize(type) {
+  switch (type) {
+    case BSER_INT8:
+      return 1;
+    case BSER_INT16:
+      return 2;
+    case BSER_INT32:
+      return 4;
+    case BSER_INT64:
+      return 8;
+    default:
+      throw new Error(`Expected an integer, got type ${type}`);
+  }
+}
+
+// File records for the synthetic stream. `kind` is 'create', 'update',
+// 'delete', or 'none' for records that produce no event.
+function syntheticFiles(
+  count,
+  {start = 0, prefix = 'file', kind = 'create', fields} = {},
+) {
+  let files = [];
+  for (let i = start; i < start + count; i++) {
+    let file = {
+      name: `${prefix}${Math.floor(i / 1000)}/${i}.js`,
+      mode: 0o100644,
+      exists: kind !== 'delete' && kind !== 'none',
+      new: kind === 'create' || kind === 'none',
+      mtime_ms: 1700000000000 + i,
+      size: i * 16,
+      ino: 1000000 + i,
+    };
+
+    if (fields) {
+      for (let key of Object.keys(file)) {
+        if (!fields.includes(key)) {
+          delete file[key];
+        }
+      }
+    }
+
+    files.push(file);
+  }
+  return files;
+}
+
+// Reads a recording, with one PDU per line.
+function readRecording(file) {
+  return fs
+    .readFileSync(file, 'utf8')
+    .split('\n')
+    .filter((line) => line.trim())
+    .map((line) => JSON.parse(line))
+    .filter((pdu) => pdu.files);
+}
+
+class FakeWatchman extends EventEmitter {
+  // Options:
+  // - `files`, `batch`: the synthetic stream sends `files` records to each
+  //   subscription, `batch` records per PDU.
+  // - `kind`: the kind of synthetic records, see syntheticFiles.
+  // - `rate`: PDUs per second, for both synthetic and recorded streams.
+  //   Defaults to sending them as fast as possible.
+  // - `replay`: a recording to send to subscriptions instead.
+  // - `queryFiles`, `queryKind`: the records returned by `query` and `since`.
+  // - `templates`: encode file records as BSER templates.
+  // - `chunk`: write PDUs in pieces of this many bytes, each on a later tick,
+  //   so that they are read in parts.
+  // - `filesFirst`: put `files` before `subscription` in subscription PDUs.
+  //   Watchman doesn't order the keys of its PDUs.
+  // - `filter`: apply the expression of each subscription to the records
+  //   sent with push(), like watchman does.
+  // - `caseSensitive`: whether `match` and `dirname` terms are case sensitive
+  //   when the query doesn't set `case_sensitive`. Watchman defaults to the
+  //   case sensitivity of the filesystem, so they aren't on macOS and Windows.
+  //
+  // A `send` event is emitted with the subscription, the index of the PDU and
+  // its records just before each PDU is written. A `command` event is emitted
+  // with each decoded command and the bytes it was read from.
+  constructor(options = {}) {
+    super();
+    this.options = {
+      files: 0,
+      batch: 1000,
+      kind: 'create',
+      rate: 0,
+      queryFiles: 0,
+      queryKind: 'create',
+      templates: false,
+      chunk: 0,
+      filesFirst: false,
+      filter: false,
+      caseSensitive:
+        process.platform !== 'darwin' && process.platform !== 'win32',
+      ...options,
+    };
+    this.recording = this.options.replay
+      ? readRecording(this.options.replay)
+      : null;
+    this.clock = 1;
+    this.responses = new Map();
+    this.subscriptions = new Map();
+    this.sockets = new Set();
+    this.timers = new Set();
+    this.server = net.createServer((socket) => this.handleConnection(socket));
+  }
+
+  listen(sockPath) {
+    this.sockPath = sockPath;
+    if (process.platform !== 'win32' && fs.existsSync(sockPath)) {
+      fs.unlinkSync(sockPath);
+    }
+
+    return new Promise((resolve, reject) => {
+      this.server.once('error', reject);
+      this.server.listen(sockPath, () => {
+        this.server.off('error', reject);
+        resolve();
+      });
+    });
+  }
+
+  close() {
+    for (let timer of this.timers) {
+      clearTimeout(timer);
+    }
+    for (let socket of this.sockets) {
+      socket.destroy();
+    }
+    return new Promise((resolve) => this.server.close(() => resolve()));
+  }
+
+  handleConnection(socket) {
+    let buffer = Buffer.alloc(0);
+    let subscriptions = new Set();
+    this.sockets.add(socket);
+    socket.on('close', () => {
+      this.sockets.delete(socket);
+      for (let name of subscriptions) {
+        this.subscriptions.delete(name);
+      }
+      subscriptions.clear();
+    });
+    socket.on('error', () => {});
+    socket.on('data', (data) => {
+      buffer = buffer.length ? Buffer.concat([buffer, data]) : data;
+      let pdu;
+      while ((pdu = decode(buffer))) {
+        this.emit('command', {
+          command: pdu.value,
+          bytes: buffer.subarray(0, pdu.length),
+        });
+        buffer = buffer.subarray(pdu.length);
+        this.handleCommand(socket, subscriptions, pdu.value);
+      }
+    });
+  }
+
+  send(socket, value) {
+    this.write(socket, encode(value));
+  }
+
+  // Writes raw bytes, in pieces of `chunk` bytes if set, and ends the
+  // connection afterwards if `end` is set. Pieces are queued per socket, so
+  // PDUs written in between don't interleave with them.
+  write(socket, bytes, end = false) {
+    if (socket.destroyed) {
+      return;
+    }
+
+    let {chunk} = this.options;
+    if (!chunk) {
+      if (end) {
+        socket.end(bytes);
+      } else {
+        socket.write(bytes);
+      }
+      return;
+    }
+
+    let queue = socket.fakeQueue || (socket.fakeQueue = []);
+    for (let i = 0; i < bytes.length; i += chunk) {
+      queue.push(bytes.subarray(i, i + chunk));
+    }
+    if (end) {
+      queue.push(null);
+    }
+
+    let flush = () => {
+      if (socket.destroyed || queue.length === 0) {
+        socket.fakeFlushing = false;
+        return;
+      }
+
+      let piece = queue.shift();
+      if (piece === null) {
+        socket.end();
+        return;
+      }
+
+      socket.write(piece);
+      let timer = setTimeout(() => {
+        this.timers.delete(timer);
+        flush();
+      }, 1);
+      this.timers.add(timer);
+    };
+
+    if (!socket.fakeFlushing) {
+      socket.fakeFlushing = true;
+      flush();
+    }
+  }
+
+  // Sends records to every subscription, or only to the given one. The name
+  // doesn't have to be subscribed, to send PDUs for unknown subscriptions.
+  push(records, {subscription} = {}) {
+    let targets = subscription
+      ? [
+          [
+            subscription,
+            this.subscriptions.get(subscription) || this.anySubscription(),
+          ],
+        ]
+      : [...this.subscriptions];
+
+    for (let [name, sub] of targets) {
+      if (!sub) {
+        continue;
+      }
+
+      let files = this.options.filter
+        ? records.filter((file) => this.matches(sub.query, file.name))
+        : records;
+      this.send(sub.socket, this.subscriptionPDU(name, sub.root, files));
+    }
+  }
+
+  // Writes raw bytes to every subscription's connection, e.g. a corrupt PDU.
+  // With `end`, the connections are ended afterwards, e.g. to truncate a PDU.
+  writeRaw(bytes, {end = false} = {}) {
+    let sockets = new Set(
+      [...this.subscriptions.values()].map((sub) => sub.socket),
+    );
+    for (let socket of sockets) {
+      this.write(socket, bytes, end);
+    }
+  }
+
+  // Closes the connections that have no subscriptions, like watchman does to
+  // idle clients when it restarts.
+  closeIdle() {
+    let subscribed = new Set(
+      [...this.subscriptions.values()].map((sub) => sub.socket),
+    );
+    for (let socket of this.sockets) {
+      if (!subscribed.has(socket)) {
+        socket.destroy();
+      }
+    }
+  }
+
+  // The latest subscription, whose connection is still being read.
+  anySubscription() {
+    return [...this.subscriptions.values()].pop();
+  }
+
+  subscriptionPDU(name, root, files) {
+    let pdu = {
+      version: '2023.01.01.00',
+      unilateral: true,
+    };
+
+    if (this.options.filesFirst) {
+      pdu.files = this.files(files);
+    }
+
+    pdu.subscription = name;
+    pdu.root = root;
+    pdu.clock = this.nextClock();
+    pdu.is_fresh_instance = false;
+    if (!this.options.filesFirst) {
+      pdu.files = this.files(files);
+    }
+
+    return pdu;
+  }
+
+  // Evaluates the subset of watchman's expression terms that the backend
+  // sends: not, anyof, dirname and match with wholename.
+  matches(query, name) {
+    if (!query.expression) {
+      return true;
+    }
+
+    let caseSensitive = query.case_sensitive ?? this.options.caseSensitive;
+    let evaluate = ([term, ...args]) => {
+      switch (term) {
+        case 'not':
+          return !evaluate(args[0]);
+        case 'anyof':
+          return args.some(evaluate);
+        case 'dirname': {
+          let dir = caseSensitive ? args[0] : args[0].toLowerCase();
+          let file = caseSensitive ? name : name.toLowerCase();
+          return file.startsWith(dir + '/');
+        }
+        case 'match': {
+          let [pattern, scope, flags = {}] = args;
+          if (scope !== 'wholename') {
+            throw new Error(`Unsupported match scope ${scope}`);
+          }
+
+          return picomatch(pattern, {
+            dot: !!flags.includedotfiles,
+            nocase: !caseSensitive,
+          })(name);
+        }
+        default:
+          throw new Error(`Unsupported expression term ${term}`);
+      }
+    };
+
+    return evaluate(query.expression);
+  }
+
+  files(files) {
+    return this.options.templates ? template(files) : files;
+  }
+
+  handleCommand(socket, subscriptions, [command, root, ...args]) {
+    switch (command) {
+      case 'version':
+        this.send(socket, {version: '2023.01.01.00'});
+        break;
+      case 'get-sockname':
+        this.send(socket, {version: '2023.01.01.00', sockname: this.sockPath});
+        break;
+      case 'watch':
+      case 'watch-project':
+        this.send(socket, {version: '2023.01.01.00', watch: root});
+        break;
+      case 'clock':
+        this.send(socket, {version: '2023.01.01.00', clock: this.nextClock()});
+        break;
+      case 'query':
+      case 'since': {
+        // Responses are cached, so that benchmarks don't measure encoding them.
+        let {queryFiles, queryKind, templates} = this.options;
+        let fields = command === 'query' ? args[0].fields : undefined;
+        let key = JSON.stringify([queryFiles, queryKind, templates, fields]);
+        if (!this.responses.has(key)) {
+          this.responses.clear();
+          this.responses.set(
+            key,
+            encode({
+              version: '2023.01.01.00',
+              clock: this.nextClock(),
+              is_fresh_instance: false,
+              files: this.files(
+                syntheticFiles(queryFiles, {kind: queryKind, fields}),
+              ),
+            }),
+          );
+        }
+        if (!socket.destroyed) {
+          socket.write(this.responses.get(key));
+        }
+        break;
+      }
+      case 'subscribe': {
+        let [name, query] = args;
+        subscriptions.add(name);
+        this.subscriptions.set(name, {socket, root, query});
+        this.send(socket, {
+          version: '2023.01.01.00',
+          subscribe: name,
+          clock: this.nextClock(),
+        });
+        this.stream(socket, subscriptions, root, name, query.fields);
+        break;
+      }
+      case 'unsubscribe':
+        subscriptions.delete(args[0]);
+        this.subscriptions.delete(args[0]);
+        this.send(socket, {
+          version: '2023.01.01.00',
+          unsubscribe: args[0],
+          deleted: true,
+        });
+        break;
+      default:
+        this.send(socket, {
+          version: '2023.01.01.00',
+          error: `unknown command ${command}`,
+        });
+    }
+  }
+
+  nextClock() {
+    return `c:0:${this.clock++}`;
+  }
+
+  // Sends the stream for a subscription, one PDU at a time.
+  stream(socket, subscriptions, root, name, fields) {
+    let {files, batch, kind, rate} = this.options;
+    let count = this.recording
+      ? this.recording.length
+      : Math.ceil(files / batch);
+    let index = 0;
+
+    let next = () => {
+      if (index >= count || !subscriptions.has(name)) {
+        return;
+      }
+
+      let records = this.recording
+        ? this.recording[index].files
+        : syntheticFiles(Math.min(batch, files - index * batch), {
+            start: index * batch,
+            kind,
+            fields,
+          });
+
+      this.emit('send', {subscription: name, index, files: records});
+      this.send(socket, this.subscriptionPDU(name, root, records));
+
+      index++;
+      schedule();
+    };
+
+    let schedule = () => {
+      if (index >= count) {
+        return;
+      }
+
+      let delay = this.recording?.[index].delay ?? (rate ? 1000 / rate : 0);
+      let timer = setTimeout(() => {
+        this.timers.delete(timer);
+        next();
+      }, delay);
+      this.timers.add(timer);
+    };
+
+    schedule();
+  }
+}
+
+function parseArgs(argv) {
+  let options = {};
+  for (let i = 0; i < argv.length; i++) {
+    let arg = argv[i];
+    if (!arg.startsWith('--')) {
+      throw new Error(`Unexpected argument ${arg}`);
+    }
+
+    let key = arg.slice(2).replace(/-([a-z])/g, (_, c) => c.toUpperCase());
+    let value = argv[i + 1];
+    if (value === undefined || value.startsWith('--')) {
+      options[key] = true;
+    } else {
+      options[key] = /^\d+(\.\d+)?$/.test(value) ? Number(value) : value;
+      i++;
+    }
+  }
+  return options;
+}
+
+if (require.main === module) {
+  let {sock, ...options} = parseArgs(process.argv.slice(2));
+  if (!sock) {
+    console.error(
+      'Usage: node benchmark/fake-watchman.js --sock <path> [--files n] [--batch n] [--rate n] [--kind create|update|delete|none] [--replay file] [--query-files n] [--templates]',
+    );
+    process.exit(1);
+  }
+
+  let server = new FakeWatchman(options);
+  let sockPath = path.resolve(sock);
+  server.listen(sockPath).then(() => {
+    console.log(`Listening on ${sockPath}`);
+  });
+}
+
+module.exports = {
+  FakeWatchman,
+  encode,
+  decode,
+  template,
+  syntheticFiles,
+  parseArgs,
+};
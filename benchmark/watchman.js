@@ -0,0 +1,225 @@
+// Benchmarks the watchman backend against the fake watchman server in this
+// directory, so results don't depend on a real watchman or the filesystem.
+//
+//   node benchmark/watchman.js [--files n] [--iterations n] [--batch n] [--rate n] [--pdus n] [--templates] [--metadata] [--replay file]
+//
+// - query: the time for getEventsSince to read `files` records that don't
+//   produce events, which is mostly reading and decoding BSER, and records
+//   that each produce an event, which adds handling them and returning the
+//   events to JS.
+// - throughput: records handled per second by a subscription when `files`
+//   records are streamed in PDUs of `batch` records as fast as possible.
+// - latency: the time from sending each PDU to the callback that receives
+//   its events, with `pdus` PDUs sent at `rate` per second. This includes the
+//   debounce before callbacks are called.
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const {performance} = require('perf_hooks');
+const {FakeWatchman, parseArgs} = require('./fake-watchman');
+
+const options = {
+  files: 100000,
+  iterations: 10,
+  batch: 1000,
+  rate: 10,
+  pdus: 50,
+  templates: false,
+  metadata: false,
+  ...parseArgs(process.argv.slice(2)),
+};
+
+const sockPath =
+  process.platform === 'win32'
+    ? `\\\\.\\pipe\\parcel-watcher-benchmark-${process.pid}`
+    : path.join(os.tmpdir(), `parcel-watcher-benchmark-${process.pid}.sock`);
+
+// The socket path must be set before the backend looks for watchman.
+process.env.WATCHMAN_SOCK = sockPath;
+const watcher = require('../');
+
+const watchOptions = {backend: 'watchman', metadata: options.metadata};
+
+function tmpDir() {
+  let dir = path.join(
+    fs.realpathSync(os.tmpdir()),
+    Math.random().toString(31).slice(2),
+  );
+  fs.mkdirSync(dir);
+  return dir;
+}
+
+function percentile(values, p) {
+  let sorted = [...values].sort((a, b) => a - b);
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function format(ms) {
+  return `${ms.toFixed(2)}ms`;
+}
+
+function rate(count, ms) {
+  return `${Math.round((count / ms) * 1000).toLocaleString()}/s`;
+}
+
+async function query(server, kind) {
+  server.options.queryFiles = options.files;
+  server.options.queryKind = kind;
+
+  let dir = tmpDir();
+  let snapshot = path.join(dir, 'snapshot.txt');
+  await watcher.writeSnapshot(dir, snapshot, watchOptions);
+
+  // Warm up the connection pool and the cached response.
+  await watcher.getEventsSince(dir, snapshot, watchOptions);
+
+  let times = [];
+  for (let i = 0; i < options.iterations; i++) {
+    let start = performance.now();
+    let events = await watcher.getEventsSince(dir, snapshot, watchOptions);
+    times.push(performance.now() - start);
+
+    let expected = kind === 'none' ? 0 : options.files;
+    if (events.length !== expected) {
+      throw new Error(`Expected ${expected} events, got ${events.length}`);
+    }
+  }
+
+  fs.rmSync(dir, {recursive: true});
+  let median = percentile(times, 0.5);
+  console.log(
+    `query (${kind === 'none' ? 'no events' : 'events'}): ${options.files} records, median ${format(median)}, ${rate(options.files, median)}`,
+  );
+  return median;
+}
+
+// Subscribes and records when each PDU is sent, and when the first event for
+// one of its records is received. Resolves once every PDU has been received,
+// or a second after the last one was sent, as records in a recording may not
+// all produce events.
+async function stream(server, streamOptions, count) {
+  Object.assign(server.options, streamOptions);
+
+  let dir = tmpDir();
+  let sent = [];
+  let received = [];
+  let pdus = new Map();
+  let remaining = count;
+  let resolve;
+  let done = new Promise((r) => (resolve = r));
+  let timeout;
+
+  let onSend = ({index, files}) => {
+    sent[index] = performance.now();
+    for (let file of files) {
+      pdus.set(file.name, index);
+    }
+
+    if (index === count - 1) {
+      timeout = setTimeout(resolve, 1000);
+    }
+  };
+  server.on('send', onSend);
+
+  let sub = await watcher.subscribe(
+    dir,
+    (err, events) => {
+      if (err) {
+        throw err;
+      }
+
+      let now = performance.now();
+      for (let event of events) {
+        let name = path.relative(dir, event.path).split(path.sep).join('/');
+        let index = pdus.get(name);
+        if (index !== undefined && received[index] === undefined) {
+          received[index] = now;
+          remaining--;
+        }
+      }
+
+      if (remaining === 0) {
+        resolve();
+      }
+    },
+    watchOptions,
+  );
+
+  await done;
+  clearTimeout(timeout);
+  await sub.unsubscribe();
+  server.off('send', onSend);
+  fs.rmSync(dir, {recursive: true});
+  return {sent, received};
+}
+
+async function throughput(server) {
+  let {sent, received} = await stream(
+    server,
+    {files: options.files, batch: options.batch, kind: 'create', rate: 0},
+    Math.ceil(options.files / options.batch),
+  );
+
+  let duration = Math.max(...received.filter(Boolean)) - sent[0];
+  console.log(
+    `throughput: ${options.files} records in PDUs of ${options.batch}, ${format(duration)}, ${rate(options.files, duration)}`,
+  );
+}
+
+async function latency(server) {
+  let count = server.recording ? server.recording.length : options.pdus;
+  let {sent, received} = await stream(
+    server,
+    {
+      files: options.pdus * options.batch,
+      batch: options.batch,
+      kind: 'create',
+      rate: options.rate,
+    },
+    count,
+  );
+
+  let latencies = [];
+  for (let i = 0; i < sent.length; i++) {
+    if (received[i] !== undefined) {
+      latencies.push(received[i] - sent[i]);
+    }
+  }
+
+  console.log(
+    `latency: ${latencies.length} of ${sent.length} PDUs received, p50 ${format(percentile(latencies, 0.5))}, p95 ${format(percentile(latencies, 0.95))}, max ${format(Math.max(...latencies))}`,
+  );
+}
+
+async function run() {
+  let server = new FakeWatchman({
+    templates: options.templates,
+    replay: options.replay,
+  });
+  await server.listen(sockPath);
+
+  try {
+    console.log(
+      `watchman backend, ${options.templates ? 'template' : 'object'} records${options.metadata ? ' with metadata' : ''}`,
+    );
+
+    let decode = await query(server, 'none');
+    let events = await query(server, 'create');
+    console.log(
+      `handling ${options.files} events: ${format(events - decode)}, ${rate(options.files, events - decode)}`,
+    );
+
+    if (!server.recording) {
+      await throughput(server);
+    }
+    await latency(server);
+  } finally {
+    await server.close();
+  }
+}
+
+run().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});
@@ -42,11 +42,14 @@
             "src/watchman/WatchmanBackend.cc",
             "src/shared/BruteForceBackend.cc",
             "src/linux/InotifyBackend.cc",
+            "src/linux/FanotifyBackend.cc",
+            "src/linux/EventLoop.cc",
             "src/unix/legacy.cc"
           ],
           "defines": [
             "WATCHMAN",
             "INOTIFY",
+            "FANOTIFY",
             "BRUTE_FORCE"
           ]
         }],
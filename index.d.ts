@@ -6,23 +6,41 @@ declare namespace ParcelWatcher {
     | 'fs-events'
     | 'watchman'
     | 'inotify'
+    | 'fanotify'
     | 'windows'
     | 'brute-force';
   export type EventType = 'create' | 'update' | 'delete';
   export interface Options {
     ignore?: (FilePath | GlobPattern | RegExp)[];
+    include?: (FilePath | GlobPattern | RegExp)[];
     backend?: BackendType;
+    completedWrites?: boolean;
+    pollingFallback?: boolean;
+    deferVcs?: boolean;
+    metadata?: boolean;
+    background?: boolean;
+    shards?: number;
   }
   export type SubscribeCallback = (
     err: Error | null,
     events: Event[],
   ) => unknown;
+  export interface ScanStats {
+    files: number;
+    directories: number;
+    duration: number;
+  }
   export interface AsyncSubscription {
+    ready: Promise<ScanStats>;
     unsubscribe(): Promise<void>;
   }
   export interface Event {
     path: FilePath;
     type: EventType;
+    mtimeMs?: number;
+    size?: number;
+    // Loses precision above Number.MAX_SAFE_INTEGER.
+    ino?: number;
   }
   export function getEventsSince(
     dir: FilePath,
@@ -10,6 +10,9 @@
 #ifdef INOTIFY
 #include "linux/InotifyBackend.hh"
 #endif
+#ifdef FANOTIFY
+#include "linux/FanotifyBackend.hh"
+#endif
 #ifdef KQUEUE
 #include "kqueue/KqueueBackend.hh"
 #endif
@@ -20,6 +23,11 @@
 
 #include "Backend.hh"
 #include <unordered_map>
+#include <algorithm>
+
+// Limit the number of instances per backend. Each one has its own thread, and
+// for inotify its own instance, which count against fs.inotify.max_user_instances.
+#define MAX_SHARDS 64
 
 static std::unordered_map<std::string, std::shared_ptr<Backend>>& getSharedBackends() {
   static std::unordered_map<std::string, std::shared_ptr<Backend>>* sharedBackends = 
@@ -46,6 +54,12 @@ std::shared_ptr<Backend> getBackend(std::string backend) {
       return std::make_shared<WindowsBackend>();
     }
   #endif
+  #ifdef FANOTIFY
+    // Requires privileges, so it is only used when asked for.
+    if (backend == "fanotify" && FanotifyBackend::checkAvailable()) {
+      return std::make_shared<FanotifyBackend>();
+    }
+  #endif
   #ifdef INOTIFY
     if (backend == "inotify" || backend == "default") {
       return std::make_shared<InotifyBackend>();
@@ -68,19 +82,29 @@ std::shared_ptr<Backend> getBackend(std::string backend) {
   return nullptr;
 }
 
-std::shared_ptr<Backend> Backend::getShared(std::string backend) {
-  auto found = getSharedBackends().find(backend);
+// When sharded, watched directories are spread across several instances of the backend,
+// so that each one handles the events for its directories on its own threads. A directory
+// is always assigned to the same instance, so later calls for it find its subscription.
+std::shared_ptr<Backend> Backend::getShared(std::string backend, std::string dir, size_t shards) {
+  std::string key = backend;
+  if (shards > 1) {
+    shards = std::min(shards, (size_t)MAX_SHARDS);
+    size_t shard = std::hash<std::string>()(dir) % shards;
+    key += "#" + std::to_string(shard) + "/" + std::to_string(shards);
+  }
+
+  auto found = getSharedBackends().find(key);
   if (found != getSharedBackends().end()) {
     return found->second;
   }
 
   auto result = getBackend(backend);
   if (!result) {
-    return getShared("default");
+    return getShared("default", dir, shards);
   }
 
   result->run();
-  getSharedBackends().emplace(backend, result);
+  getSharedBackends().emplace(key, result);
   return result;
 }
 
@@ -142,17 +166,39 @@ Backend::~Backend() {
   #endif
 }
 
-void Backend::watch(WatcherRef watcher) {
+// Returns what was crawled to subscribe, which is nothing if the watcher was already subscribed.
+ScanStats Backend::watch(WatcherRef watcher) {
   std::unique_lock<std::mutex> lock(mMutex);
-  auto res = mSubscriptions.find(watcher);
-  if (res == mSubscriptions.end()) {
-    try {
-      this->subscribe(watcher);
-      mSubscriptions.insert(watcher);
-    } catch (std::exception&) {
-      unref();
-      throw;
-    }
+  if (mSubscriptions.find(watcher) != mSubscriptions.end()) {
+    return ScanStats();
+  }
+
+  // Slow work like crawling happens without the lock so that existing subscriptions
+  // keep receiving events in the meantime. Only registering the result is locked.
+  lock.unlock();
+  std::shared_ptr<PreparedSubscription> prepared;
+  try {
+    prepared = this->prepareSubscribe(watcher);
+  } catch (std::exception&) {
+    lock.lock();
+    unref();
+    throw;
+  }
+
+  lock.lock();
+  if (mSubscriptions.find(watcher) != mSubscriptions.end()) {
+    // Subscribed by another thread while we were preparing.
+    this->cancelSubscribe(prepared);
+    return ScanStats();
+  }
+
+  try {
+    ScanStats stats = this->completeSubscribe(watcher, prepared);
+    mSubscriptions.insert(watcher);
+    return stats;
+  } catch (std::exception&) {
+    unref();
+    throw;
   }
 }
 
@@ -6,6 +6,21 @@
 #include "Signal.hh"
 #include <thread>
 
+// Counts of the entries that were crawled when subscribing.
+struct ScanStats {
+  size_t files = 0;
+  size_t directories = 0;
+};
+
+// State produced by Backend::prepareSubscribe, which runs without a lock on mMutex.
+class PreparedSubscription {
+public:
+  virtual ~PreparedSubscription() = default;
+
+  // The entries crawled while preparing. Empty if the tree was already cached.
+  ScanStats stats;
+};
+
 class Backend {
 public:
   virtual ~Backend();
@@ -17,21 +32,29 @@ public:
   virtual void getEventsSince(WatcherRef watcher, std::string *snapshotPath) = 0;
   virtual void subscribe(WatcherRef watcher) = 0;
   virtual void unsubscribe(WatcherRef watcher) = 0;
-
-  static std::shared_ptr<Backend> getShared(std::string backend);
-
-  void watch(WatcherRef watcher);
+  virtual std::shared_ptr<PreparedSubscription> prepareSubscribe(WatcherRef watcher) {
+    return nullptr;
+  }
+  virtual ScanStats completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) {
+    subscribe(watcher);
+    return ScanStats();
+  }
+  virtual void cancelSubscribe(std::shared_ptr<PreparedSubscription> prepared) {}
+
+  static std::shared_ptr<Backend> getShared(std::string backend, std::string dir = "", size_t shards = 1);
+
+  ScanStats watch(WatcherRef watcher);
   void unwatch(WatcherRef watcher);
   void unref();
   void handleWatcherError(WatcherError &err);
 
   std::mutex mMutex;
   std::thread mThread;
+protected:
+  void handleError(std::exception &err);
 private:
   std::unordered_set<WatcherRef> mSubscriptions;
   Signal mStartedSignal;
-
-  void handleError(std::exception &err);
 };
 
 #endif
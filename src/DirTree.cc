@@ -18,7 +18,7 @@ struct DirTreeDeleter {
   void operator()(DirTree *tree) {
     std::lock_guard<std::mutex> lock(mDirCacheMutex());
     std::unordered_map<std::string, std::weak_ptr<DirTree>> &cache = dirTreeCache();
-    cache.erase(tree->root);
+    cache.erase(tree->cacheKey);
     delete tree;
 
     // Free up memory.
@@ -28,11 +28,13 @@ struct DirTreeDeleter {
   }
 };
 
-std::shared_ptr<DirTree> DirTree::getCached(std::string root) {
+// The key distinguishes trees of the same root that were crawled with different filters.
+std::shared_ptr<DirTree> DirTree::getCached(std::string root, std::string key) {
   std::lock_guard<std::mutex> lock(mDirCacheMutex());
   std::unordered_map<std::string, std::weak_ptr<DirTree>> &cache = dirTreeCache();
 
-  auto found = cache.find(root);
+  std::string cacheKey = root + key;
+  auto found = cache.find(cacheKey);
   std::shared_ptr<DirTree> tree;
 
   // Use cached tree, or create an empty one.
@@ -40,7 +42,8 @@ std::shared_ptr<DirTree> DirTree::getCached(std::string root) {
     tree = found->second.lock();
   } else {
     tree = std::shared_ptr<DirTree>(new DirTree(root), DirTreeDeleter());
-    cache.emplace(root, tree);
+    tree->cacheKey = cacheKey;
+    cache.emplace(cacheKey, tree);
   }
 
   return tree;
@@ -85,6 +88,7 @@ DirEntry *DirTree::update(std::string path, uint64_t mtime) {
   DirEntry *found = _find(path);
   if (found) {
     found->mtime = mtime;
+    dirty.erase(path);
   }
 
   return found;
@@ -92,7 +96,11 @@ DirEntry *DirTree::update(std::string path, uint64_t mtime) {
 
 void DirTree::remove(std::string path) {
   std::lock_guard<std::mutex> lock(mDirCacheMutex());
+  _remove(path);
+}
 
+// Internal remove method that has no lock
+void DirTree::_remove(std::string path) {
   DirEntry *found = _find(path);
 
   // Remove all sub-entries if this is a directory
@@ -100,6 +108,7 @@ void DirTree::remove(std::string path) {
     std::string pathStart = path + DIR_SEP;
     for (auto it = entries.begin(); it != entries.end();) {
       if (it->first.rfind(pathStart, 0) == 0) {
+        dirty.erase(it->first);
         it = entries.erase(it);
       } else {
         it++;
@@ -107,9 +116,86 @@ void DirTree::remove(std::string path) {
     }
   }
 
+  dirty.erase(path);
   entries.erase(path);
 }
 
+// Moves an entry and all of its sub-entries to a new path, replacing anything that was there.
+// Returns false if there was no entry at the old path.
+bool DirTree::rename(std::string from, std::string to) {
+  std::lock_guard<std::mutex> lock(mDirCacheMutex());
+
+  DirEntry *found = _find(from);
+  if (!found) {
+    return false;
+  }
+
+  _remove(to);
+
+  std::vector<std::string> paths;
+  paths.push_back(from);
+  if (found->isDir) {
+    std::string pathStart = from + DIR_SEP;
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+      if (it->first.rfind(pathStart, 0) == 0) {
+        paths.push_back(it->first);
+      }
+    }
+  }
+
+  for (auto it = paths.begin(); it != paths.end(); it++) {
+    auto entry = entries.find(*it);
+    DirEntry moved = std::move(entry->second);
+    entries.erase(entry);
+    moved.path = to + it->substr(from.size());
+    if (dirty.erase(*it) > 0) {
+      dirty.insert(moved.path);
+    }
+
+    entries.emplace(moved.path, std::move(moved));
+  }
+
+  return true;
+}
+
+// Returns the path itself if it is a directory, and all directories below it.
+std::vector<std::string> DirTree::findDirs(std::string path) {
+  std::lock_guard<std::mutex> lock(mDirCacheMutex());
+
+  std::vector<std::string> dirs;
+  DirEntry *found = _find(path);
+  if (!found || !found->isDir) {
+    return dirs;
+  }
+
+  dirs.push_back(path);
+  std::string pathStart = path + DIR_SEP;
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    if (it->second.isDir && it->first.rfind(pathStart, 0) == 0) {
+      dirs.push_back(it->first);
+    }
+  }
+
+  return dirs;
+}
+
+// Marks an entry as modified without knowing its new mtime yet.
+void DirTree::markDirty(std::string path) {
+  std::lock_guard<std::mutex> lock(mDirCacheMutex());
+
+  if (_find(path)) {
+    dirty.insert(path);
+  }
+}
+
+std::vector<std::string> DirTree::takeDirty() {
+  std::lock_guard<std::mutex> lock(mDirCacheMutex());
+
+  std::vector<std::string> paths(dirty.begin(), dirty.end());
+  dirty.clear();
+  return paths;
+}
+
 void DirTree::write(FILE *f) {
   std::lock_guard<std::mutex> lock(mDirCacheMutex());
 
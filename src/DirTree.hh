@@ -3,6 +3,8 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <memory>
 #include "Event.hh"
 
@@ -28,23 +30,31 @@ struct DirEntry {
 
 class DirTree {
 public:
-  static std::shared_ptr<DirTree> getCached(std::string root);
+  static std::shared_ptr<DirTree> getCached(std::string root, std::string key = "");
   DirTree(std::string root) : root(root), isComplete(false) {}
   DirTree(std::string root, FILE *f);
   DirEntry *add(std::string path, uint64_t mtime, bool isDir);
   DirEntry *find(std::string path);
   DirEntry *update(std::string path, uint64_t mtime);
   void remove(std::string path);
+  bool rename(std::string from, std::string to);
+  std::vector<std::string> findDirs(std::string path);
+  void markDirty(std::string path);
+  std::vector<std::string> takeDirty();
   void write(FILE *f);
   void getChanges(DirTree *snapshot, EventList &events);
 
   std::mutex mMutex;
   std::string root;
+  std::string cacheKey;
   bool isComplete;
   std::unordered_map<std::string, DirEntry> entries;
+  // Entries whose mtime is stale and must be refreshed before it is read.
+  std::unordered_set<std::string> dirty;
 
 private:
   DirEntry *_find(std::string path);
+  void _remove(std::string path);
 };
 
 #endif
@@ -8,13 +8,23 @@
 #include <mutex>
 #include <map>
 #include <optional>
+#include <functional>
 
 using namespace Napi;
 
+// Metadata of a file as reported by a backend that already has it, so that
+// consumers don't need to stat the file again.
+struct EventMetadata {
+  int64_t mtimeMs;
+  int64_t size;
+  uint64_t ino;
+};
+
 struct Event {
   std::string path;
   bool isCreated;
   bool isDeleted;
+  std::optional<EventMetadata> metadata;
   Event(std::string path) : path(path), isCreated(false), isDeleted(false) {}
 
   Value toJS(const Env& env) {
@@ -23,15 +33,26 @@ struct Event {
     std::string type = isCreated ? "create" : isDeleted ? "delete" : "update";
     res.Set(String::New(env, "path"), String::New(env, path.c_str()));
     res.Set(String::New(env, "type"), String::New(env, type.c_str()));
+    if (metadata && !isDeleted) {
+      res.Set(String::New(env, "mtimeMs"), Number::New(env, static_cast<double>(metadata->mtimeMs)));
+      res.Set(String::New(env, "size"), Number::New(env, static_cast<double>(metadata->size)));
+      // Loses precision above 2^53. BigInt would need N-API version 6.
+      res.Set(String::New(env, "ino"), Number::New(env, static_cast<double>(metadata->ino)));
+    }
     return scope.Escape(res);
   }
 };
 
 class EventList {
 public:
-  void create(std::string path) {
+  void create(std::string path, std::optional<EventMetadata> metadata = std::nullopt) {
+    if (isFiltered(path)) {
+      return;
+    }
+
     std::lock_guard<std::mutex> l(mMutex);
     Event *event = internalUpdate(path);
+    event->metadata = metadata;
     if (event->isDeleted) {
       // Assume update event when rapidly removed and created
       // https://github.com/parcel-bundler/watcher/issues/72
@@ -41,12 +62,24 @@ public:
     }
   }
 
-  Event *update(std::string path) {
+  Event *update(std::string path, std::optional<EventMetadata> metadata = std::nullopt) {
+    if (isFiltered(path)) {
+      return nullptr;
+    }
+
     std::lock_guard<std::mutex> l(mMutex);
-    return internalUpdate(path);
+    Event *event = internalUpdate(path);
+    if (metadata) {
+      event->metadata = metadata;
+    }
+    return event;
   }
 
   void remove(std::string path) {
+    if (isFiltered(path)) {
+      return;
+    }
+
     std::lock_guard<std::mutex> l(mMutex);
     Event *event = internalUpdate(path);
     event->isDeleted = true;
@@ -91,10 +124,21 @@ public:
     return mError.value_or("");
   }
 
+  // Set once by the owning watcher before any events are added.
+  void setFilter(std::function<bool(const std::string &)> filter) {
+    mFilter = filter;
+  }
+
 private:
   mutable std::mutex mMutex;
   std::map<std::string, Event> mEvents;
   std::optional<std::string> mError;
+  std::function<bool(const std::string &)> mFilter;
+
+  bool isFiltered(const std::string &path) {
+    return mFilter && !mFilter(path);
+  }
+
   Event *internalUpdate(std::string path) {
     auto found = mEvents.find(path);
     if (found == mEvents.end()) {
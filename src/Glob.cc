@@ -4,17 +4,25 @@
 extern "C" bool wasm_regex_match(const char *s, const char *regex);
 #endif
 
-Glob::Glob(std::string raw) {
+Glob::Glob(std::string raw, std::string pattern) {
   mRaw = raw;
+  mPattern = pattern;
   mHash = std::hash<std::string>()(raw);
   #ifndef __wasm32__
     mRegex = std::regex(raw);
+  #else
+    mRegex = Regex::compile(raw);
   #endif
 }
 
-bool Glob::isIgnored(std::string relative_path) const {
-  // Use native JS regex engine for wasm to reduce binary size.
+bool Glob::matches(std::string relative_path) const {
+  // Use a compact native engine for wasm to avoid crossing into JS for every path,
+  // and fall back to the JS regex engine for patterns it doesn't support.
   #ifdef __wasm32__
+    if (mRegex) {
+      return mRegex->match(relative_path);
+    }
+
     return wasm_regex_match(relative_path.c_str(), mRaw.c_str());
   #else
     return std::regex_match(relative_path, mRegex);
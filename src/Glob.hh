@@ -3,21 +3,32 @@
 
 #include <unordered_set>
 #include <regex>
+#include <memory>
+
+#ifdef __wasm32__
+#include "wasm/Regex.hh"
+#endif
 
 struct Glob {
   std::size_t mHash;
   std::string mRaw;
+  // The glob this regex was made from, if any. Lets backends that understand
+  // globs filter on their side.
+  std::string mPattern;
   #ifndef __wasm32__
   std::regex mRegex;
+  #else
+  // Null if the pattern uses syntax the native engine doesn't support.
+  std::shared_ptr<Regex> mRegex;
   #endif
 
-  Glob(std::string raw);
+  Glob(std::string raw, std::string pattern = "");
 
   bool operator==(const Glob &other) const {
     return mHash == other.mHash && mRaw == other.mRaw;
   }
 
-  bool isIgnored(std::string relative_path) const;
+  bool matches(std::string relative_path) const;
 };
 
 namespace std
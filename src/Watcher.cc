@@ -21,8 +21,8 @@ static std::unordered_set<WatcherRef , WatcherHash, WatcherCompare>& getSharedWa
   return *sharedWatchers;
 }
 
-WatcherRef Watcher::getShared(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs) {
-  WatcherRef watcher = std::make_shared<Watcher>(dir, ignorePaths, ignoreGlobs);
+WatcherRef Watcher::getShared(std::string dir, WatcherOptions options) {
+  WatcherRef watcher = std::make_shared<Watcher>(dir, std::move(options));
   auto found = getSharedWatchers().find(watcher);
   if (found != getSharedWatchers().end()) {
     return *found;
@@ -46,10 +46,24 @@ void removeShared(Watcher *watcher) {
   }
 }
 
-Watcher::Watcher(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs)
+Watcher::Watcher(std::string dir, WatcherOptions options)
   : mDir(dir),
-    mIgnorePaths(ignorePaths),
-    mIgnoreGlobs(ignoreGlobs) {
+    mIgnorePaths(std::move(options.ignorePaths)),
+    mIgnoreGlobs(std::move(options.ignoreGlobs)),
+    mIncludeDirs(std::move(options.includeDirs)),
+    mIncludeGlobs(std::move(options.includeGlobs)),
+    mCompletedWrites(options.completedWrites),
+    mPollingFallback(options.pollingFallback),
+    mDeferVcs(options.deferVcs),
+    mMetadata(options.metadata) {
+      // Backends prune with isIgnored and isIncluded before doing any work, but filter
+      // here as well so that no backend can emit events for paths that aren't included.
+      if (mIncludeGlobs.size() > 0) {
+        mEvents.setFilter([this] (const std::string &path) {
+          return isIncluded(path);
+        });
+      }
+
       mDebounce = Debounce::getShared();
       mDebounce->add(this, [this] () {
         triggerCallbacks();
@@ -69,7 +83,7 @@ void Watcher::notify() {
   std::unique_lock<std::mutex> lk(mMutex);
   mCond.notify_all();
 
-  if (mCallbacks.size() > 0 && mEvents.size() > 0) {
+  if (mCallbacks.size() > 0 && (mEvents.size() > 0 || mEvents.hasError())) {
     // We must release our lock before calling into the debouncer
     // to avoid a deadlock: the debouncer thread itself will require
     // our lock from its thread when calling into `triggerCallbacks`
@@ -223,6 +237,24 @@ bool Watcher::isIgnored(std::string path) {
     }
   }
 
+  // If there are include patterns, ignore anything that is neither inside nor
+  // a parent of a directory that could contain a match. This prunes crawls.
+  if (mIncludeDirs.size() > 0) {
+    bool canContainMatch = false;
+    auto pathStart = path + DIR_SEP;
+    for (auto it = mIncludeDirs.begin(); it != mIncludeDirs.end(); it++) {
+      auto dir = *it + DIR_SEP;
+      if (*it == path || path.compare(0, dir.size(), dir) == 0 || it->compare(0, pathStart.size(), pathStart) == 0) {
+        canContainMatch = true;
+        break;
+      }
+    }
+
+    if (!canContainMatch) {
+      return true;
+    }
+  }
+
   auto basePath = mDir + DIR_SEP;
 
   if (path.rfind(basePath, 0) != 0) {
@@ -232,7 +264,31 @@ bool Watcher::isIgnored(std::string path) {
   auto relativePath = path.substr(basePath.size());
 
   for (auto it = mIgnoreGlobs.begin(); it != mIgnoreGlobs.end(); it++) {
-    if (it->isIgnored(relativePath)) {
+    if (it->matches(relativePath)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Returns whether events should be emitted for the path. Directories that could contain
+// included files but don't match themselves still need to be crawled and watched.
+bool Watcher::isIncluded(std::string path) {
+  if (mIncludeGlobs.size() == 0) {
+    return true;
+  }
+
+  auto basePath = mDir + DIR_SEP;
+
+  if (path.rfind(basePath, 0) != 0) {
+    return true;
+  }
+
+  auto relativePath = path.substr(basePath.size());
+
+  for (auto it = mIncludeGlobs.begin(); it != mIncludeGlobs.end(); it++) {
+    if (it->matches(relativePath)) {
       return true;
     }
   }
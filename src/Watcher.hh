@@ -22,6 +22,19 @@ struct Callback {
   std::thread::id threadId;
 };
 
+// The options a watcher was created with. Watchers with the same directory and
+// options are shared.
+struct WatcherOptions {
+  std::unordered_set<std::string> ignorePaths;
+  std::unordered_set<Glob> ignoreGlobs;
+  std::unordered_set<std::string> includeDirs;
+  std::unordered_set<Glob> includeGlobs;
+  bool completedWrites = false;
+  bool pollingFallback = false;
+  bool deferVcs = true;
+  bool metadata = false;
+};
+
 class WatcherState {
 public:
     virtual ~WatcherState() = default;
@@ -31,14 +44,23 @@ struct Watcher {
   std::string mDir;
   std::unordered_set<std::string> mIgnorePaths;
   std::unordered_set<Glob> mIgnoreGlobs;
+  std::unordered_set<std::string> mIncludeDirs;
+  std::unordered_set<Glob> mIncludeGlobs;
+  bool mCompletedWrites;
+  bool mPollingFallback;
+  bool mDeferVcs;
+  bool mMetadata;
   EventList mEvents;
   std::shared_ptr<WatcherState> state;
 
-  Watcher(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs);
+  Watcher(std::string dir, WatcherOptions options = {});
   ~Watcher();
 
   bool operator==(const Watcher &other) const {
-    return mDir == other.mDir && mIgnorePaths == other.mIgnorePaths && mIgnoreGlobs == other.mIgnoreGlobs;
+    return mDir == other.mDir && mIgnorePaths == other.mIgnorePaths && mIgnoreGlobs == other.mIgnoreGlobs
+      && mIncludeDirs == other.mIncludeDirs && mIncludeGlobs == other.mIncludeGlobs
+      && mCompletedWrites == other.mCompletedWrites && mPollingFallback == other.mPollingFallback
+      && mDeferVcs == other.mDeferVcs && mMetadata == other.mMetadata;
   }
 
   void wait();
@@ -48,9 +70,10 @@ struct Watcher {
   bool unwatch(Function callback);
   void unref();
   bool isIgnored(std::string path);
+  bool isIncluded(std::string path);
   void destroy();
 
-  static WatcherRef getShared(std::string dir, std::unordered_set<std::string> ignorePaths, std::unordered_set<Glob> ignoreGlobs);
+  static WatcherRef getShared(std::string dir, WatcherOptions options = {});
 
 private:
   std::mutex mMutex;
@@ -1,4 +1,5 @@
 #include <unordered_set>
+#include <chrono>
 #include <node_api.h>
 #include "wasm/include.h"
 #include <napi.h>
@@ -10,11 +11,11 @@
 
 using namespace Napi;
 
-std::unordered_set<std::string> getIgnorePaths(Env env, Value opts) {
+std::unordered_set<std::string> getPaths(Env env, Value opts, const char *key) {
   std::unordered_set<std::string> result;
 
   if (opts.IsObject()) {
-    Value v = opts.As<Object>().Get(String::New(env, "ignorePaths"));
+    Value v = opts.As<Object>().Get(String::New(env, key));
     if (v.IsArray()) {
       Array items = v.As<Array>();
       for (size_t i = 0; i < items.Length(); i++) {
@@ -29,19 +30,30 @@ std::unordered_set<std::string> getIgnorePaths(Env env, Value opts) {
   return result;
 }
 
-std::unordered_set<Glob> getIgnoreGlobs(Env env, Value opts) {
+// `patternsKey` names an optional array with the glob each regex was made from,
+// at the same index.
+std::unordered_set<Glob> getGlobs(Env env, Value opts, const char *key, const char *patternsKey = nullptr) {
   std::unordered_set<Glob> result;
 
   if (opts.IsObject()) {
-    Value v = opts.As<Object>().Get(String::New(env, "ignoreGlobs"));
+    Value v = opts.As<Object>().Get(String::New(env, key));
+    Value patterns = patternsKey ? opts.As<Object>().Get(String::New(env, patternsKey)) : env.Undefined();
     if (v.IsArray()) {
       Array items = v.As<Array>();
       for (size_t i = 0; i < items.Length(); i++) {
         Value item = items.Get(Number::New(env, static_cast<double>(i)));
         if (item.IsString()) {
           auto key = item.As<String>().Utf8Value();
+          std::string pattern;
+          if (patterns.IsArray()) {
+            Value p = patterns.As<Array>().Get(Number::New(env, static_cast<double>(i)));
+            if (p.IsString()) {
+              pattern = p.As<String>().Utf8Value();
+            }
+          }
+
           try {
-            result.emplace(key);
+            result.emplace(key, pattern);
           } catch (const std::regex_error& e) {
             Error::New(env, e.what()).ThrowAsJavaScriptException();
           }
@@ -53,14 +65,65 @@ std::unordered_set<Glob> getIgnoreGlobs(Env env, Value opts) {
   return result;
 }
 
-std::shared_ptr<Backend> getBackend(Env env, Value opts) {
+bool getBool(Env env, Value opts, const char *key, bool defaultValue = false) {
+  if (opts.IsObject()) {
+    Value v = opts.As<Object>().Get(String::New(env, key));
+    if (v.IsBoolean()) {
+      return v.As<Boolean>().Value();
+    }
+  }
+
+  return defaultValue;
+}
+
+WatcherOptions getWatcherOptions(Env env, Value opts) {
+  WatcherOptions options;
+  options.ignorePaths = getPaths(env, opts, "ignorePaths");
+  options.ignoreGlobs = getGlobs(env, opts, "ignoreGlobs", "ignoreGlobPatterns");
+  options.includeDirs = getPaths(env, opts, "includeDirs");
+  options.includeGlobs = getGlobs(env, opts, "includeGlobs");
+  options.completedWrites = getBool(env, opts, "completedWrites");
+  options.pollingFallback = getBool(env, opts, "pollingFallback");
+  options.deferVcs = getBool(env, opts, "deferVcs", true);
+  options.metadata = getBool(env, opts, "metadata");
+  return options;
+}
+
+// Returns the shared watcher for the directory and options, or a new one that
+// isn't shared, e.g. to collect the events since a snapshot.
+WatcherRef getWatcher(Env env, Value dir, Value opts, bool shared) {
+  std::string path = std::string(dir.As<String>().Utf8Value().c_str());
+  if (shared) {
+    return Watcher::getShared(path, getWatcherOptions(env, opts));
+  }
+
+  return std::make_shared<Watcher>(path, getWatcherOptions(env, opts));
+}
+
+std::shared_ptr<Backend> getBackend(Env env, Value opts, WatcherRef watcher) {
   Value b = opts.As<Object>().Get(String::New(env, "backend"));
   std::string backendName;
   if (b.IsString()) {
     backendName = std::string(b.As<String>().Utf8Value().c_str());
   }
 
-  return Backend::getShared(backendName);
+  size_t shards = 1;
+#ifndef __wasm32__
+  Value s = opts.As<Object>().Get(String::New(env, "shards"));
+  if (s.IsNumber() && s.As<Number>().DoubleValue() > 1) {
+    shards = static_cast<size_t>(s.As<Number>().DoubleValue());
+  }
+#endif
+
+  return Backend::getShared(backendName, watcher->mDir, shards);
+}
+
+Value scanStatsToJS(Env env, ScanStats &stats, double duration) {
+  Object result = Object::New(env);
+  result.Set(String::New(env, "files"), Number::New(env, static_cast<double>(stats.files)));
+  result.Set(String::New(env, "directories"), Number::New(env, static_cast<double>(stats.directories)));
+  result.Set(String::New(env, "duration"), Number::New(env, duration));
+  return result;
 }
 
 class WriteSnapshotRunner : public PromiseRunner {
@@ -68,13 +131,9 @@ public:
   WriteSnapshotRunner(Env env, Value dir, Value snap, Value opts)
     : PromiseRunner(env),
       snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())) {
-    watcher = Watcher::getShared(
-      std::string(dir.As<String>().Utf8Value().c_str()),
-      getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
-    );
+    watcher = getWatcher(env, dir, opts, true);
 
-    backend = getBackend(env, opts);
+    backend = getBackend(env, opts, watcher);
   }
 
   ~WriteSnapshotRunner() {
@@ -96,13 +155,9 @@ public:
   GetEventsSinceRunner(Env env, Value dir, Value snap, Value opts)
     : PromiseRunner(env),
       snapshotPath(std::string(snap.As<String>().Utf8Value().c_str())) {
-    watcher = std::make_shared<Watcher>(
-      std::string(dir.As<String>().Utf8Value().c_str()),
-      getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
-    );
+    watcher = getWatcher(env, dir, opts, false);
 
-    backend = getBackend(env, opts);
+    backend = getBackend(env, opts, watcher);
   }
 
   ~GetEventsSinceRunner() {
@@ -164,14 +219,10 @@ Value getEventsSince(const CallbackInfo& info) {
 
 class SubscribeRunner : public PromiseRunner {
 public:
-  SubscribeRunner(Env env, Value dir, Value fn, Value opts) : PromiseRunner(env) {
-    watcher = Watcher::getShared(
-      std::string(dir.As<String>().Utf8Value().c_str()),
-      getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
-    );
-
-    backend = getBackend(env, opts);
+  SubscribeRunner(Env env, Value dir, Value fn, Value opts) : PromiseRunner(env), duration(0) {
+    watcher = getWatcher(env, dir, opts, true);
+
+    backend = getBackend(env, opts, watcher);
     watcher->watch(fn.As<Function>());
   }
 
@@ -179,27 +230,91 @@ private:
   WatcherRef watcher;
   std::shared_ptr<Backend> backend;
   FunctionReference callback;
+  ScanStats stats;
+  double duration;
 
   void execute() override {
+    auto start = std::chrono::steady_clock::now();
     try {
-      backend->watch(watcher);
+      stats = backend->watch(watcher);
     } catch (std::exception&) {
       watcher->destroy();
       throw;
     }
+
+    duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  Value getResult() override {
+    return scanStatsToJS(env, stats, duration);
+  }
+};
+
+#ifndef __wasm32__
+// Subscribes on a dedicated thread instead of the libuv thread pool, so that crawling a large
+// directory doesn't hold up other work. The returned promise resolves once the subscription is
+// ready. Events that happen in the meantime are queued by the backend and delivered afterwards.
+class BackgroundSubscribeRunner {
+public:
+  BackgroundSubscribeRunner(Env env, Value dir, Value fn, Value opts)
+    : deferred(Promise::Deferred::New(env)), duration(0) {
+    watcher = getWatcher(env, dir, opts, true);
+
+    backend = getBackend(env, opts, watcher);
+    watcher->watch(fn.As<Function>());
+
+    // Only used to get back onto the JS thread, which also keeps the process alive until then.
+    tsfn = ThreadSafeFunction::New(env, fn.As<Function>(), "Watcher ready", 0, 1);
+  }
+
+  Value queue() {
+    Value promise = deferred.Promise();
+    std::thread([this] () {
+      auto start = std::chrono::steady_clock::now();
+      try {
+        stats = backend->watch(watcher);
+      } catch (std::exception &err) {
+        watcher->destroy();
+        error = err.what();
+      }
+
+      duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      ThreadSafeFunction fn = tsfn;
+      fn.BlockingCall(this, onReady);
+      fn.Release();
+    }).detach();
+
+    return promise;
+  }
+
+private:
+  Promise::Deferred deferred;
+  ThreadSafeFunction tsfn;
+  WatcherRef watcher;
+  std::shared_ptr<Backend> backend;
+  ScanStats stats;
+  double duration;
+  std::string error;
+
+  static void onReady(Napi::Env env, Function fn, BackgroundSubscribeRunner *self) {
+    HandleScope scope(env);
+    if (self->error.size() > 0) {
+      self->deferred.Reject(Error::New(env, self->error).Value());
+    } else {
+      self->deferred.Resolve(scanStatsToJS(env, self->stats, self->duration));
+    }
+
+    delete self;
   }
 };
+#endif
 
 class UnsubscribeRunner : public PromiseRunner {
 public:
   UnsubscribeRunner(Env env, Value dir, Value fn, Value opts) : PromiseRunner(env) {
-    watcher = Watcher::getShared(
-      std::string(dir.As<String>().Utf8Value().c_str()),
-      getIgnorePaths(env, opts),
-      getIgnoreGlobs(env, opts)
-    );
+    watcher = getWatcher(env, dir, opts, true);
 
-    backend = getBackend(env, opts);
+    backend = getBackend(env, opts, watcher);
     shouldUnwatch = watcher->unwatch(fn.As<Function>());
   }
 
@@ -238,6 +353,12 @@ Value queueSubscriptionWork(const CallbackInfo& info) {
 }
 
 Value subscribe(const CallbackInfo& info) {
+  #ifndef __wasm32__
+    if (info.Length() >= 3 && getBool(info.Env(), info[2], "background")) {
+      return queueSubscriptionWork<BackgroundSubscribeRunner>(info);
+    }
+  #endif
+
   return queueSubscriptionWork<SubscribeRunner>(info);
 }
 
@@ -0,0 +1,149 @@
+#include <stdexcept>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "EventLoop.hh"
+
+#define MAX_EVENTS 64
+
+EventLoop &EventLoop::getShared() {
+  // Never destroyed, like the shared backends that use it.
+  static EventLoop *loop = new EventLoop();
+  return *loop;
+}
+
+EventLoop::EventLoop() : mRunningFd(-1), mRunning(false) {
+  mEpoll = epoll_create1(EPOLL_CLOEXEC);
+  if (mEpoll == -1) {
+    throw std::runtime_error(std::string("Unable to create epoll instance: ") + strerror(errno));
+  }
+
+  mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (mEventFd == -1) {
+    throw std::runtime_error(std::string("Unable to create eventfd: ") + strerror(errno));
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = mEventFd;
+  if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mEventFd, &event) == -1) {
+    throw std::runtime_error(std::string("Unable to watch eventfd: ") + strerror(errno));
+  }
+}
+
+void EventLoop::add(int fd, std::function<void()> handler, std::function<void(std::exception &)> errorHandler) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+    throw std::runtime_error(std::string("Unable to add to epoll: ") + strerror(errno));
+  }
+
+  mHandlers[fd] = std::make_shared<std::function<void()>>(handler);
+  mErrorHandlers[fd] = errorHandler;
+
+  // The previous thread has already left its loop once it marked itself as stopped.
+  if (!mRunning) {
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+
+    mRunning = true;
+    mThread = std::thread([this] () {
+      run();
+    });
+  }
+}
+
+// Once this returns, the handler is no longer running and won't be called again,
+// unless it is called from the handler itself.
+void EventLoop::remove(int fd) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  if (mHandlers.erase(fd) == 0) {
+    return;
+  }
+
+  mErrorHandlers.erase(fd);
+  epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, NULL);
+  if (mHandlers.empty()) {
+    wake();
+  }
+
+  if (std::this_thread::get_id() != mThread.get_id()) {
+    mCondition.wait(lock, [this, fd] { return mRunningFd != fd; });
+  }
+}
+
+void EventLoop::wake() {
+  uint64_t value = 1;
+  write(mEventFd, &value, sizeof(value));
+}
+
+void EventLoop::run() {
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int count = epoll_wait(mEpoll, events, MAX_EVENTS, -1);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      std::runtime_error err(std::string("Unable to wait for events: ") + strerror(errno));
+      fail(err);
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == mEventFd) {
+        uint64_t value;
+        read(mEventFd, &value, sizeof(value));
+        continue;
+      }
+
+      // A handler may have been removed by an earlier one in the same batch.
+      auto found = mHandlers.find(fd);
+      if (found == mHandlers.end()) {
+        continue;
+      }
+
+      std::shared_ptr<std::function<void()>> handler = found->second;
+      mRunningFd = fd;
+      lock.unlock();
+      (*handler)();
+      lock.lock();
+      mRunningFd = -1;
+      mCondition.notify_all();
+    }
+
+    if (mHandlers.empty()) {
+      mRunning = false;
+      return;
+    }
+  }
+}
+
+// epoll_wait only fails if the epoll instance is unusable, so every handler is removed,
+// the thread stops, and each backend is told through its error handler. Called on the
+// loop thread, which must not throw.
+void EventLoop::fail(std::exception &err) {
+  std::unordered_map<int, std::function<void(std::exception &)>> errorHandlers;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (auto it = mHandlers.begin(); it != mHandlers.end(); it++) {
+      epoll_ctl(mEpoll, EPOLL_CTL_DEL, it->first, NULL);
+    }
+
+    mHandlers.clear();
+    errorHandlers.swap(mErrorHandlers);
+    mRunning = false;
+  }
+
+  // The handlers may remove their backend, which calls remove() from this thread.
+  for (auto it = errorHandlers.begin(); it != errorHandlers.end(); it++) {
+    it->second(err);
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// A single epoll thread shared by the Linux backends. Handlers are called on that
+// thread whenever their fd is readable, and should only read and hand the data off
+// to their backend, so that one backend can't hold up the others. It blocks without
+// a timeout, and is woken through an eventfd when handlers are removed. The thread
+// only runs while there are handlers.
+class EventLoop {
+public:
+  static EventLoop &getShared();
+  void add(int fd, std::function<void()> handler, std::function<void(std::exception &)> errorHandler);
+  void remove(int fd);
+
+private:
+  int mEpoll;
+  int mEventFd;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::unordered_map<int, std::shared_ptr<std::function<void()>>> mHandlers;
+  std::unordered_map<int, std::function<void(std::exception &)>> mErrorHandlers;
+  int mRunningFd;
+  bool mRunning;
+
+  EventLoop();
+  void run();
+  void wake();
+  void fail(std::exception &err);
+};
+
+#endif
@@ -0,0 +1,584 @@
+#include <memory>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "FanotifyBackend.hh"
+#include "EventLoop.hh"
+
+// Directory events are only reported with file handles, which requires
+// FAN_REPORT_DFID_NAME (Linux 5.9). Marking the whole filesystem means
+// that no per-directory marks are needed.
+#define FANOTIFY_INIT_FLAGS (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME)
+#define FANOTIFY_MASK \
+  FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | \
+  FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR
+#define FANOTIFY_ENTRY_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)
+#define FANOTIFY_UPDATE_MASK (FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB)
+#define BUFFER_SIZE 65536
+// Upper bound on raw event data waiting for the processing thread. Past this,
+// events are dropped and handled like a kernel queue overflow.
+#define MAX_QUEUED_BYTES (64 * 1024 * 1024)
+#define MAX_HANDLE_PATHS 100000
+#define MAX_PENDING_PATHS 100000
+#define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
+
+// Defined in unix/legacy.cc, and used to crawl directories that are moved into a watched root.
+void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const char *relative, int parent_fd, const std::string &dirname, ScanStats *stats = nullptr);
+
+static std::string getFsid(const void *fsid) {
+  return std::string((const char *)fsid, sizeof(fsid_t));
+}
+
+static bool isInRoot(std::string &path, WatcherRef watcher) {
+  return path == watcher->mDir || path.compare(0, watcher->mDir.size() + 1, watcher->mDir + "/") == 0;
+}
+
+bool FanotifyBackend::checkAvailable() {
+  // Requires CAP_SYS_ADMIN.
+  int fd = fanotify_init(FANOTIFY_INIT_FLAGS, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  close(fd);
+  return true;
+}
+
+void FanotifyBackend::start() {
+  mFanotify = fanotify_init(FANOTIFY_INIT_FLAGS, O_RDONLY | O_CLOEXEC);
+  if (mFanotify == -1) {
+    throw std::runtime_error(std::string("Unable to initialize fanotify: ") + strerror(errno));
+  }
+
+  // Events are processed on a separate thread, so that the shared event loop only has to
+  // copy them out of the kernel while we stat files, crawl directories and update trees.
+  mProcessorThread = std::thread([this] () {
+    processEvents();
+  });
+
+  EventLoop::getShared().add(mFanotify, [this] () {
+    try {
+      readEvents();
+    } catch (std::exception &err) {
+      handleError(err);
+    }
+  }, [this] (std::exception &err) {
+    handleError(err);
+  });
+
+  notifyStarted();
+}
+
+FanotifyBackend::~FanotifyBackend() {
+  if (mFanotify == -1) {
+    return;
+  }
+
+  // The processing thread uses the fanotify fd and the mount fds, so make sure it is done first.
+  EventLoop::getShared().remove(mFanotify);
+  stopProcessing();
+  for (auto it = mFilesystems.begin(); it != mFilesystems.end(); it++) {
+    close(it->second.mountFd);
+  }
+
+  close(mFanotify);
+}
+
+// Marks the filesystem of the watched root, unless another watcher already did.
+// Returns its fsid. Must be called with a lock on mMutex.
+std::string FanotifyBackend::markFilesystem(WatcherRef watcher) {
+  int fd = open(watcher->mDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    throw WatcherError(strerror(errno), watcher);
+  }
+
+  struct statfs st;
+  if (fstatfs(fd, &st) != 0) {
+    close(fd);
+    throw WatcherError(strerror(errno), watcher);
+  }
+
+  std::string fsid = getFsid(&st.f_fsid);
+  auto found = mFilesystems.find(fsid);
+  if (found == mFilesystems.end()) {
+    if (fanotify_mark(mFanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, fd, ".") == -1) {
+      std::string err = strerror(errno);
+      close(fd);
+      throw WatcherError(std::string("fanotify_mark on '") + watcher->mDir + std::string("' failed: ") + err, watcher);
+    }
+
+    found = mFilesystems.emplace(fsid, FanotifyFilesystem{fd, 0}).first;
+  } else {
+    close(fd);
+  }
+
+  found->second.refs++;
+  return fsid;
+}
+
+// Removes the mark once no watcher uses the filesystem. Must be called with a lock on mMutex.
+void FanotifyBackend::unmarkFilesystem(WatcherRef watcher, std::string fsid) {
+  auto fs = mFilesystems.find(fsid);
+  if (fs == mFilesystems.end() || --fs->second.refs > 0) {
+    return;
+  }
+
+  int mountFd = fs->second.mountFd;
+  mFilesystems.erase(fs);
+  mHandlePaths.clear();
+
+  int err = fanotify_mark(mFanotify, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, mountFd, ".");
+  close(mountFd);
+  if (err == -1) {
+    throw WatcherError(std::string("Unable to remove watcher: ") + strerror(errno), watcher);
+  }
+}
+
+// This function is called by Backend::watch which takes a lock on mMutex
+void FanotifyBackend::subscribe(WatcherRef watcher) {
+  // Mark the filesystem before crawling, so that nothing that changes during the crawl is missed.
+  std::string fsid = markFilesystem(watcher);
+  mSubscriptions[watcher] = FanotifySubscription{nullptr, fsid};
+
+  try {
+    mSubscriptions[watcher].tree = getTree(watcher);
+  } catch (std::exception &) {
+    unsubscribe(watcher);
+    throw;
+  }
+}
+
+// Crawls the tree without holding mMutex, so that events for other subscriptions keep being
+// processed. The paths that change in the meantime are recorded, so that they can be
+// reconciled with the new tree once the subscription is registered.
+std::shared_ptr<PreparedSubscription> FanotifyBackend::prepareSubscribe(WatcherRef watcher) {
+  std::shared_ptr<FanotifyPreparedSubscription> prepared = std::make_shared<FanotifyPreparedSubscription>();
+  prepared->watcher = watcher;
+  bool isComplete;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    prepared->fsid = markFilesystem(watcher);
+    mPendingWatchers.insert(watcher);
+    isComplete = getTree(watcher, false)->isComplete;
+  }
+
+  if (!isComplete) {
+    try {
+      prepared->tree = std::make_shared<DirTree>(watcher->mDir);
+      readTree(watcher, prepared->tree, &prepared->stats);
+    } catch (std::exception &) {
+      std::unique_lock<std::mutex> lock(mMutex);
+      cancelSubscribe(prepared);
+      throw;
+    }
+  }
+
+  return prepared;
+}
+
+// This function is called by Backend::watch which takes a lock on mMutex
+ScanStats FanotifyBackend::completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) {
+  if (!prepared) {
+    subscribe(watcher);
+    return ScanStats();
+  }
+
+  FanotifyPreparedSubscription &fanotifyPrepared = static_cast<FanotifyPreparedSubscription &>(*prepared);
+  std::shared_ptr<DirTree> tree = getTree(watcher, false);
+  if (fanotifyPrepared.tree && !tree->isComplete) {
+    tree->entries = std::move(fanotifyPrepared.tree->entries);
+    tree->isComplete = true;
+  }
+
+  FanotifySubscription &sub = mSubscriptions[watcher];
+  sub = FanotifySubscription{tree, fanotifyPrepared.fsid};
+
+  // Entries are stat'ed when handling a path, so the order the paths changed in doesn't matter.
+  bool hasEvents = false;
+  for (auto it = mPendingPaths.begin(); it != mPendingPaths.end(); it++) {
+    std::string path = it->first;
+    if (handleSubscription(it->second, path, watcher, sub)) {
+      hasEvents = true;
+    }
+  }
+
+  // Too many paths changed to keep track of them, or events were dropped.
+  bool overflowed = mPendingOverflowed;
+  finishPending(watcher);
+  if (hasEvents) {
+    watcher->notify();
+  }
+
+  if (overflowed) {
+    requestRescan();
+  }
+
+  return prepared->stats;
+}
+
+// This function is called with a lock on mMutex
+void FanotifyBackend::cancelSubscribe(std::shared_ptr<PreparedSubscription> prepared) {
+  if (!prepared) {
+    return;
+  }
+
+  FanotifyPreparedSubscription &fanotifyPrepared = static_cast<FanotifyPreparedSubscription &>(*prepared);
+  finishPending(fanotifyPrepared.watcher);
+  unmarkFilesystem(fanotifyPrepared.watcher, fanotifyPrepared.fsid);
+}
+
+// Must be called with a lock on mMutex
+void FanotifyBackend::finishPending(WatcherRef watcher) {
+  auto found = mPendingWatchers.find(watcher);
+  if (found != mPendingWatchers.end()) {
+    mPendingWatchers.erase(found);
+  }
+
+  if (mPendingWatchers.empty()) {
+    mPendingPaths.clear();
+    mPendingOverflowed = false;
+  }
+}
+
+// This function is called by Backend::unwatch which takes a lock on mMutex
+void FanotifyBackend::unsubscribe(WatcherRef watcher) {
+  auto found = mSubscriptions.find(watcher);
+  if (found == mSubscriptions.end()) {
+    return;
+  }
+
+  std::string fsid = found->second.fsid;
+  mSubscriptions.erase(found);
+  unmarkFilesystem(watcher, fsid);
+}
+
+// Called on the shared event loop. Only copies the events out of the kernel.
+void FanotifyBackend::readEvents() {
+  while (true) {
+    std::vector<char> buf(BUFFER_SIZE);
+    ssize_t len = read(mFanotify, buf.data(), buf.size());
+    if (len == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        break;
+      }
+
+      throw std::runtime_error(std::string("Error reading from fanotify: ") + strerror(errno));
+    }
+
+    if (len == 0) {
+      break;
+    }
+
+    buf.resize(len);
+
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      if (mQueuedBytes + len > MAX_QUEUED_BYTES) {
+        // The processing thread is too far behind. Drop the events and re-scan instead.
+        mQueueOverflowed = true;
+      } else {
+        mQueuedBytes += len;
+        mQueue.push_back(std::move(buf));
+      }
+    }
+
+    mQueueCondition.notify_one();
+  }
+}
+
+void FanotifyBackend::processEvents() {
+  std::deque<std::vector<char>> buffers;
+
+  while (true) {
+    bool overflowed;
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      mQueueCondition.wait(lock, [this] {
+        return !mQueue.empty() || mQueueOverflowed || mQueueStopped;
+      });
+
+      if (mQueueStopped) {
+        return;
+      }
+
+      // Take everything that has been read so far, so that watchers are notified once per batch.
+      buffers.swap(mQueue);
+      mQueuedBytes = 0;
+      overflowed = mQueueOverflowed;
+      mQueueOverflowed = false;
+    }
+
+    try {
+      handleEvents(buffers, overflowed);
+    } catch (std::exception &err) {
+      // The backend may be destroyed by this, so don't touch it afterwards.
+      handleError(err);
+      return;
+    }
+
+    buffers.clear();
+  }
+}
+
+void FanotifyBackend::stopProcessing() {
+  {
+    std::unique_lock<std::mutex> lock(mQueueMutex);
+    mQueueStopped = true;
+  }
+
+  mQueueCondition.notify_one();
+  if (mProcessorThread.joinable()) {
+    // The backend is destroyed from the processing thread itself when it fails.
+    if (mProcessorThread.get_id() == std::this_thread::get_id()) {
+      mProcessorThread.detach();
+    } else {
+      mProcessorThread.join();
+    }
+  }
+}
+
+// Re-scans on the processing thread. Called with a lock on mMutex.
+void FanotifyBackend::requestRescan() {
+  {
+    std::unique_lock<std::mutex> lock(mQueueMutex);
+    mQueueOverflowed = true;
+  }
+
+  mQueueCondition.notify_one();
+}
+
+void FanotifyBackend::handleEvents(std::deque<std::vector<char>> &buffers, bool overflowed) {
+  // Track all of the watchers that are touched so we can notify them at the end of the events.
+  std::unordered_set<WatcherRef> watchers;
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (auto it = buffers.begin(); it != buffers.end(); it++) {
+      ssize_t len = it->size();
+      struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *)it->data();
+      for (; FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len)) {
+        if (metadata->vers != FANOTIFY_METADATA_VERSION) {
+          throw std::runtime_error("Unsupported fanotify metadata version");
+        }
+
+        // The kernel dropped events, so we can no longer trust the trees.
+        // Keep handling the rest, and re-scan once this batch is done.
+        if (metadata->mask & FAN_Q_OVERFLOW) {
+          overflowed = true;
+          continue;
+        }
+
+        handleEvent(metadata, watchers);
+      }
+    }
+
+    // Subscriptions that are being prepared re-scan once they are registered.
+    if (overflowed && !mPendingWatchers.empty()) {
+      mPendingOverflowed = true;
+    }
+  }
+
+  for (auto it = watchers.begin(); it != watchers.end(); it++) {
+    (*it)->notify();
+  }
+
+  if (overflowed) {
+    rescan();
+  }
+}
+
+// Called from handleEvents, which holds a lock on mMutex
+void FanotifyBackend::handleEvent(struct fanotify_event_metadata *metadata, std::unordered_set<WatcherRef> &watchers) {
+  // With FAN_REPORT_DFID_NAME, events carry the file handle of the directory and the entry name.
+  struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(metadata + 1);
+  if ((char *)(fid + 1) > (char *)metadata + metadata->event_len) {
+    return;
+  }
+
+  if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+    return;
+  }
+
+  struct file_handle *handle = (struct file_handle *)fid->handle;
+  std::string fsid = getFsid(&fid->fsid);
+  std::string path = resolveHandle(fsid, handle);
+  if (path.empty()) {
+    return;
+  }
+
+  const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+  if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME && strcmp(name, ".") != 0) {
+    path += "/" + std::string(name);
+  }
+
+  // Moved and deleted directories leave stale paths behind.
+  uint64_t mask = metadata->mask;
+  if ((mask & FAN_ONDIR) && (mask & FANOTIFY_ENTRY_MASK & ~FAN_CREATE)) {
+    mHandlePaths.clear();
+  }
+
+  // Subscriptions that are still being prepared reconcile these paths once they are registered.
+  for (auto it = mPendingWatchers.begin(); it != mPendingWatchers.end() && !mPendingOverflowed; it++) {
+    if (isInRoot(path, *it)) {
+      if (mPendingPaths.size() >= MAX_PENDING_PATHS) {
+        mPendingOverflowed = true;
+        mPendingPaths.clear();
+      } else {
+        mPendingPaths[path] |= mask;
+      }
+
+      break;
+    }
+  }
+
+  for (auto it = mSubscriptions.begin(); it != mSubscriptions.end(); it++) {
+    if (it->second.fsid == fsid && it->second.tree && handleSubscription(mask, path, it->first, it->second)) {
+      watchers.insert(it->first);
+    }
+  }
+}
+
+// Events on the same entry may be merged, so their order is lost. Instead of replaying
+// the mask, the entry is stat'ed and the tree reconciled with what is on disk.
+bool FanotifyBackend::handleSubscription(uint64_t mask, std::string &path, WatcherRef watcher, FanotifySubscription &sub) {
+  if (!isInRoot(path, watcher)) {
+    return false;
+  }
+
+  bool isDir = mask & FAN_ONDIR;
+  if (watcher->isIgnored(path) || (!isDir && !watcher->isIncluded(path))) {
+    return false;
+  }
+
+  // The mark carries both write events, so drop the one this watcher didn't ask for.
+  mask &= ~(uint64_t)(watcher->mCompletedWrites ? FAN_MODIFY : FAN_CLOSE_WRITE);
+  if (!(mask & (FANOTIFY_ENTRY_MASK | FANOTIFY_UPDATE_MASK))) {
+    return false;
+  }
+
+  std::shared_ptr<DirTree> tree = sub.tree;
+  DirEntry *entry = tree->find(path);
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    if (!entry) {
+      return false;
+    }
+
+    watcher->mEvents.remove(path);
+    tree->remove(path);
+    return true;
+  }
+
+  if (!entry) {
+    watcher->mEvents.create(path);
+    tree->add(path, CONVERT_TIME(st.st_mtim), S_ISDIR(st.st_mode));
+
+    // The directory may have been moved in, or filled before we got to it.
+    if (S_ISDIR(st.st_mode)) {
+      std::shared_ptr<DirTree> contents = std::make_shared<DirTree>(path);
+      try {
+        iterateDir(watcher, contents, path.c_str(), AT_FDCWD, path);
+      } catch (WatcherError &) {
+        // Deleted while crawling. The delete event follows.
+      }
+
+      for (auto it = contents->entries.begin(); it != contents->entries.end(); it++) {
+        if (it->first != path && !tree->find(it->first)) {
+          watcher->mEvents.create(it->first);
+          tree->add(it->first, it->second.mtime, it->second.isDir);
+        }
+      }
+    }
+
+    return true;
+  }
+
+  // An entry that was replaced or recreated is an update, as for other backends.
+  uint64_t mtime = CONVERT_TIME(st.st_mtim);
+  if (entry->isDir || (!(mask & FANOTIFY_UPDATE_MASK) && entry->mtime == mtime)) {
+    return false;
+  }
+
+  watcher->mEvents.update(path);
+  tree->update(path, mtime);
+  return true;
+}
+
+// Resolves a directory file handle to its current path.
+std::string FanotifyBackend::resolveHandle(std::string &fsid, struct file_handle *handle) {
+  std::string key = fsid + std::string((const char *)handle, sizeof(*handle) + handle->handle_bytes);
+  auto cached = mHandlePaths.find(key);
+  if (cached != mHandlePaths.end()) {
+    return cached->second;
+  }
+
+  auto fs = mFilesystems.find(fsid);
+  if (fs == mFilesystems.end()) {
+    return "";
+  }
+
+  // Requires CAP_DAC_READ_SEARCH. Deleted directories can no longer be opened.
+  int fd = open_by_handle_at(fs->second.mountFd, handle, O_PATH | O_CLOEXEC);
+  if (fd == -1) {
+    return "";
+  }
+
+  char procPath[32];
+  char buf[PATH_MAX];
+  snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(procPath, buf, sizeof(buf));
+  close(fd);
+  if (len <= 0) {
+    return "";
+  }
+
+  if (mHandlePaths.size() >= MAX_HANDLE_PATHS) {
+    mHandlePaths.clear();
+  }
+
+  std::string path(buf, len);
+  mHandlePaths.emplace(key, path);
+  return path;
+}
+
+// The kernel dropped events, so re-crawl every watched root and diff it against its tree.
+// Runs on the processing thread, so no other events are handled meanwhile. The crawls don't
+// hold mMutex, and the events that arrive during them are reconciled with the trees afterwards.
+void FanotifyBackend::rescan() {
+  std::vector<std::pair<WatcherRef, std::shared_ptr<DirTree>>> trees;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mHandlePaths.clear();
+    for (auto it = mSubscriptions.begin(); it != mSubscriptions.end(); it++) {
+      if (it->second.tree) {
+        trees.emplace_back(it->first, it->second.tree);
+      }
+    }
+  }
+
+  for (auto it = trees.begin(); it != trees.end(); it++) {
+    WatcherRef watcher = it->first;
+    std::shared_ptr<DirTree> fresh = std::make_shared<DirTree>(watcher->mDir);
+    try {
+      readTree(watcher, fresh);
+    } catch (WatcherError &) {
+      continue;
+    }
+
+    // The watcher may have unsubscribed during the crawl.
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto found = mSubscriptions.find(watcher);
+    if (found == mSubscriptions.end() || found->second.tree != it->second) {
+      continue;
+    }
+
+    std::shared_ptr<DirTree> tree = it->second;
+    fresh->getChanges(tree.get(), watcher->mEvents);
+    tree->entries = std::move(fresh->entries);
+    tree->dirty.clear();
+    lock.unlock();
+    watcher->notify();
+  }
+}
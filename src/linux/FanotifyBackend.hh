@@ -0,0 +1,79 @@
+#ifndef FANOTIFY_H
+#define FANOTIFY_H
+
+#include <unordered_map>
+#include <deque>
+#include <condition_variable>
+#include <sys/fanotify.h>
+#include "../shared/BruteForceBackend.hh"
+#include "../DirTree.hh"
+
+struct FanotifySubscription {
+  std::shared_ptr<DirTree> tree;
+  std::string fsid;
+};
+
+// A filesystem marked for at least one watcher. File handles in its events
+// are resolved relative to mountFd, which is also used to remove the mark.
+struct FanotifyFilesystem {
+  int mountFd;
+  size_t refs;
+};
+
+// The filesystem marked for a subscription before it is registered.
+class FanotifyPreparedSubscription : public PreparedSubscription {
+public:
+  WatcherRef watcher;
+  std::string fsid;
+  // The crawled tree, unless the cached tree was already complete.
+  std::shared_ptr<DirTree> tree;
+};
+
+class FanotifyBackend : public BruteForceBackend {
+public:
+  FanotifyBackend() : mFanotify(-1), mQueuedBytes(0), mQueueOverflowed(false), mQueueStopped(false), mPendingOverflowed(false) {}
+  static bool checkAvailable();
+  void start() override;
+  ~FanotifyBackend();
+  void subscribe(WatcherRef watcher) override;
+  void unsubscribe(WatcherRef watcher) override;
+  std::shared_ptr<PreparedSubscription> prepareSubscribe(WatcherRef watcher) override;
+  ScanStats completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) override;
+  void cancelSubscribe(std::shared_ptr<PreparedSubscription> prepared) override;
+private:
+  int mFanotify;
+  std::unordered_map<WatcherRef, FanotifySubscription> mSubscriptions;
+  std::unordered_map<std::string, FanotifyFilesystem> mFilesystems;
+  // Paths of recently seen directories, keyed by fsid and file handle.
+  std::unordered_map<std::string, std::string> mHandlePaths;
+
+  // Raw event buffers handed from the event loop to the processing thread.
+  std::mutex mQueueMutex;
+  std::condition_variable mQueueCondition;
+  std::deque<std::vector<char>> mQueue;
+  std::thread mProcessorThread;
+  size_t mQueuedBytes;
+  bool mQueueOverflowed;
+  bool mQueueStopped;
+
+  // Paths changed while subscriptions are being prepared, with their event masks. They are
+  // reconciled with the new trees once the subscriptions are registered.
+  std::unordered_multiset<WatcherRef> mPendingWatchers;
+  std::unordered_map<std::string, uint64_t> mPendingPaths;
+  bool mPendingOverflowed;
+
+  std::string markFilesystem(WatcherRef watcher);
+  void unmarkFilesystem(WatcherRef watcher, std::string fsid);
+  void finishPending(WatcherRef watcher);
+  void readEvents();
+  void processEvents();
+  void stopProcessing();
+  void requestRescan();
+  void handleEvents(std::deque<std::vector<char>> &buffers, bool overflowed);
+  void handleEvent(struct fanotify_event_metadata *metadata, std::unordered_set<WatcherRef> &watchers);
+  bool handleSubscription(uint64_t mask, std::string &path, WatcherRef watcher, FanotifySubscription &sub);
+  std::string resolveHandle(std::string &fsid, struct file_handle *handle);
+  void rescan();
+};
+
+#endif
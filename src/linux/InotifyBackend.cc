@@ -1,107 +1,559 @@
 #include <memory>
-#include <poll.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <algorithm>
 #include "InotifyBackend.hh"
+#include "EventLoop.hh"
 
 #define INOTIFY_MASK \
   IN_ATTRIB | IN_CREATE | IN_DELETE | \
-  IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | \
+  IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | \
   IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK
+// Watchers that only want completed writes are notified on close instead of on every write.
+#define INOTIFY_WRITE_MASK(watcher) (watcher->mCompletedWrites ? IN_CLOSE_WRITE : IN_MODIFY)
 #define BUFFER_SIZE 8192
+// Upper bound on raw event data waiting for the processing thread. Past this,
+// events are dropped and handled like a kernel queue overflow.
+#define MAX_QUEUED_BYTES (64 * 1024 * 1024)
+#define MAX_SPARE_BUFFERS 16
 #define CONVERT_TIME(ts) ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec)
+#define ISDOT(a) (a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
+// How often directories that don't fit in the watch limit are polled, and how many
+// of them may be switched to inotify per poll.
+#define POLL_INTERVAL 2000
+#define MAX_PROMOTIONS 32
+// Polled directories whose mtime didn't change are only read every this many polls.
+// Writing to an existing file doesn't change the mtime of its directory.
+#define FULL_POLL_INTERVAL 8
 
-void InotifyBackend::start() {
-  // Create a pipe that we will write to when we want to end the thread.
-  int err = pipe2(mPipe, O_CLOEXEC | O_NONBLOCK);
-  if (err == -1) {
-    throw std::runtime_error(std::string("Unable to open pipe: ") + strerror(errno));
+// The watch limit is per user, so the budget is shared by all instances in the process,
+// e.g. when watchers are sharded, and the watches they use are counted together.
+static std::mutex watchBudgetMutex;
+static size_t watchBudget = SIZE_MAX;
+static size_t watchCount = 0;
+static bool isWatchBudgetRead = false;
+
+// Leave some of the limit to other processes like editors.
+static void readWatchBudget() {
+  std::unique_lock<std::mutex> lock(watchBudgetMutex);
+  if (isWatchBudgetRead) {
+    return;
+  }
+
+  isWatchBudgetRead = true;
+
+  // Internal, so that tests can use up the budget without creating thousands of directories.
+  const char *budget = getenv("PARCEL_WATCHER_INOTIFY_WATCH_BUDGET");
+  if (budget) {
+    watchBudget = strtoull(budget, nullptr, 10);
+    return;
+  }
+
+  FILE *f = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+  if (!f) {
+    return;
+  }
+
+  size_t limit;
+  int count = fscanf(f, "%zu", &limit);
+  fclose(f);
+  if (count == 1) {
+    watchBudget = limit - limit / 8;
+  }
+}
+
+// Called when the limit was reached before the budget was used up, because of other processes.
+static void limitWatchBudget() {
+  std::unique_lock<std::mutex> lock(watchBudgetMutex);
+  watchBudget = std::min(watchBudget, watchCount);
+}
+
+// Lists the entries of a polled directory, filtered the same way as crawlDir.
+static bool readPolledDir(WatcherRef watcher, std::string path, std::vector<InotifyPolledEntry> &entries) {
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    return false;
+  }
+
+  int fd = dirfd(dir);
+  while (struct dirent *ent = readdir(dir)) {
+    if (ISDOT(ent->d_name)) {
+      continue;
+    }
+
+    std::string fullPath = path + "/" + ent->d_name;
+    if (watcher->isIgnored(fullPath)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    bool isDir = S_ISDIR(st.st_mode);
+    if (!isDir && !watcher->isIncluded(fullPath)) {
+      continue;
+    }
+
+    entries.push_back({ent->d_name, CONVERT_TIME(st.st_mtim), isDir});
   }
 
+  closedir(dir);
+  return true;
+}
+
+void InotifyBackend::start() {
   // Init inotify file descriptor.
   mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
   if (mInotify == -1) {
     throw std::runtime_error(std::string("Unable to initialize inotify: ") + strerror(errno));
   }
 
-  pollfd pollfds[2];
-  pollfds[0].fd = mPipe[0];
-  pollfds[0].events = POLLIN;
-  pollfds[0].revents = 0;
-  pollfds[1].fd = mInotify;
-  pollfds[1].events = POLLIN;
-  pollfds[1].revents = 0;
+  readWatchBudget();
 
-  notifyStarted();
+  // Internal, so that tests can drop every event to force a resync.
+  const char *maxQueuedBytes = getenv("PARCEL_WATCHER_INOTIFY_MAX_QUEUED_BYTES");
+  mMaxQueuedBytes = maxQueuedBytes ? strtoull(maxQueuedBytes, nullptr, 10) : MAX_QUEUED_BYTES;
 
-  // Loop until we get an event from the pipe.
-  while (true) {
-    int result = poll(pollfds, 2, 500);
-    if (result < 0) {
-      throw std::runtime_error(std::string("Unable to poll: ") + strerror(errno));
-    }
+  // Events are processed on a separate thread so that the event loop only has to
+  // copy them out of the kernel, which keeps the kernel queue from overflowing
+  // while we stat files and update trees.
+  mProcessorThread = std::thread([this] () {
+    processEvents();
+  });
 
-    if (pollfds[0].revents) {
-      break;
+  // The event loop is shared with the other Linux backends, and only wakes up for events.
+  EventLoop::getShared().add(mInotify, [this] () {
+    try {
+      readEvents();
+    } catch (std::exception &err) {
+      handleError(err);
     }
+  }, [this] (std::exception &err) {
+    handleError(err);
+  });
 
-    if (pollfds[1].revents) {
-      handleEvents();
-    }
+  notifyStarted();
+}
+
+InotifyBackend::~InotifyBackend() {
+  if (mInotify == -1) {
+    return;
   }
 
-  close(mPipe[0]);
-  close(mPipe[1]);
+  // The processing, resync and poll threads use the inotify fd, so make sure they
+  // are done first. Processing may request a resync, so it is stopped first.
+  EventLoop::getShared().remove(mInotify);
+  stopProcessing();
+  stopResync();
+  stopPolling();
+
   close(mInotify);
 
-  mEndedSignal.notify();
+  // Closing the instance removes all of its watches.
+  std::unique_lock<std::mutex> lock(watchBudgetMutex);
+  watchCount -= mSubscriptions.size();
 }
 
-InotifyBackend::~InotifyBackend() {
-  write(mPipe[1], "X", 1);
-  mEndedSignal.wait();
+void InotifyBackend::writeSnapshot(WatcherRef watcher, std::string *snapshotPath) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    refreshTree(getTree(watcher));
+  }
+
+  BruteForceBackend::writeSnapshot(watcher, snapshotPath);
+}
+
+void InotifyBackend::getEventsSince(WatcherRef watcher, std::string *snapshotPath) {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    refreshTree(getTree(watcher));
+  }
+
+  BruteForceBackend::getEventsSince(watcher, snapshotPath);
+}
+
+// Stats the entries that were modified since the last refresh. Must be called with a lock on mMutex.
+void InotifyBackend::refreshTree(std::shared_ptr<DirTree> tree) {
+  std::vector<std::string> paths = tree->takeDirty();
+  struct stat st;
+  for (auto it = paths.begin(); it != paths.end(); it++) {
+    if (stat(it->c_str(), &st) == 0) {
+      tree->update(*it, CONVERT_TIME(st.st_mtim));
+    }
+  }
 }
 
 // This function is called by Backend::watch which takes a lock on mMutex
 void InotifyBackend::subscribe(WatcherRef watcher) {
-  // Build a full directory tree recursively, and watch each directory.
-  std::shared_ptr<DirTree> tree = getTree(watcher);
+  std::vector<std::string> dirs;
+  bool isComplete = getWatchedDirs(watcher, dirs);
+
+  InotifyPreparedSubscription prepared;
+  prepared.watchBudget = getRemainingWatches();
+  addWatches(watcher, prepared, isComplete ? &dirs : nullptr);
+  registerSubscription(watcher, prepared);
+}
+
+// Crawls and adds the watches without holding mMutex, so that events for other subscriptions
+// keep being processed. Events received in the meantime are kept, so that the ones for the new
+// watches can be replayed once the subscription is registered.
+std::shared_ptr<PreparedSubscription> InotifyBackend::prepareSubscribe(WatcherRef watcher) {
+  std::vector<std::string> dirs;
+  bool isComplete;
+  std::shared_ptr<InotifyPreparedSubscription> prepared = std::make_shared<InotifyPreparedSubscription>();
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingSubscriptions++;
+    isComplete = getWatchedDirs(watcher, dirs);
+    prepared->watchBudget = getRemainingWatches();
+  }
+
+  try {
+    addWatches(watcher, *prepared, isComplete ? &dirs : nullptr);
+  } catch (std::exception &) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    cancelSubscribe(prepared);
+    throw;
+  }
+
+  return prepared;
+}
+
+// This function is called by Backend::watch which takes a lock on mMutex
+ScanStats InotifyBackend::completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) {
+  if (!prepared) {
+    subscribe(watcher);
+    return ScanStats();
+  }
+
+  InotifyPreparedSubscription &inotifyPrepared = static_cast<InotifyPreparedSubscription &>(*prepared);
+  registerSubscription(watcher, inotifyPrepared);
+  replayPendingEvents(watcher, inotifyPrepared);
+
+  // Events for the new watches may have been dropped, which the replay can't make up for.
+  bool overflowed = mPendingOverflowed;
+  finishPending();
+  if (overflowed) {
+    requestResync();
+  }
+
+  return prepared->stats;
+}
+
+// This function is called with a lock on mMutex
+void InotifyBackend::cancelSubscribe(std::shared_ptr<PreparedSubscription> prepared) {
+  if (!prepared) {
+    return;
+  }
+
+  // Remove the watches that no registered subscription uses. If other subscriptions are still
+  // being prepared they may share them, so the watches are left alone. Their events are ignored.
+  InotifyPreparedSubscription &inotifyPrepared = static_cast<InotifyPreparedSubscription &>(*prepared);
+  for (auto it = inotifyPrepared.watches.begin(); mPendingSubscriptions == 1 && it != inotifyPrepared.watches.end(); it++) {
+    if (mSubscriptions.count(it->first) == 0) {
+      inotify_rm_watch(mInotify, it->first);
+    }
+  }
+
+  finishPending();
+}
+
+void InotifyBackend::finishPending() {
+  mPendingSubscriptions--;
+  if (mPendingSubscriptions == 0) {
+    mPendingEvents.clear();
+    mPendingEvents.shrink_to_fit();
+    mPendingOverflowed = false;
+  }
+}
+
+// Collects the directories to watch if the tree was already crawled for another subscription
+// or snapshot. Returns false if it still needs to be crawled. Must be called with a lock on mMutex.
+bool InotifyBackend::getWatchedDirs(WatcherRef watcher, std::vector<std::string> &dirs) {
+  std::shared_ptr<DirTree> tree = getTree(watcher, false);
+  if (!tree->isComplete) {
+    return false;
+  }
 
   for (auto it = tree->entries.begin(); it != tree->entries.end(); it++) {
     if (it->second.isDir) {
-      bool success = watchDir(watcher, it->second.path, tree);
-      if (!success) {
-        throw WatcherError(std::string("inotify_add_watch on '") + it->second.path + std::string("' failed: ") + strerror(errno), watcher);
+      dirs.push_back(it->second.path);
+    }
+  }
+
+  return true;
+}
+
+// Adds a watch for each directory, crawling the tree first unless dirs are given.
+void InotifyBackend::addWatches(WatcherRef watcher, InotifyPreparedSubscription &prepared, std::vector<std::string> *dirs) {
+  if (!dirs) {
+    prepared.tree = std::make_shared<DirTree>(watcher->mDir);
+    crawlTree(watcher, prepared);
+    return;
+  }
+
+  for (auto it = dirs->begin(); it != dirs->end(); it++) {
+    bool success = watchDir(watcher, *it, nullptr, &prepared);
+    if (!success) {
+      throw WatcherError(std::string("inotify_add_watch on '") + *it + std::string("' failed: ") + strerror(errno), watcher);
+    }
+  }
+}
+
+// Builds a full directory tree recursively, watching each directory as soon as the crawler
+// reaches it so that registering watches overlaps with the rest of the crawl.
+void InotifyBackend::crawlTree(WatcherRef watcher, InotifyPreparedSubscription &prepared) {
+  int fd = open(watcher->mDir.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+  if (fd == -1) {
+    throw WatcherError(strerror(errno), watcher);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw WatcherError(strerror(errno), watcher);
+  }
+
+  if (!watchDir(watcher, watcher->mDir, prepared.tree, &prepared)) {
+    close(fd);
+    throw WatcherError(std::string("inotify_add_watch on '") + watcher->mDir + std::string("' failed: ") + strerror(errno), watcher);
+  }
+
+  prepared.tree->add(watcher->mDir, CONVERT_TIME(st.st_mtim), true);
+  prepared.stats.directories++;
+  crawlDir(watcher, watcher->mDir, prepared.tree, fd, &prepared);
+}
+
+// Must be called with a lock on mMutex
+void InotifyBackend::registerSubscription(WatcherRef watcher, InotifyPreparedSubscription &prepared) {
+  std::shared_ptr<DirTree> tree = getTree(watcher, false);
+  if (prepared.tree && !tree->isComplete) {
+    tree->entries = std::move(prepared.tree->entries);
+    tree->isComplete = true;
+  }
+
+  for (auto it = prepared.watches.begin(); it != prepared.watches.end(); it++) {
+    std::shared_ptr<InotifySubscription> sub = std::make_shared<InotifySubscription>();
+    sub->tree = tree;
+    sub->path = it->second;
+    sub->watcher = watcher;
+    sub->wd = it->first;
+    addSubscription(sub);
+  }
+
+  for (auto it = prepared.polled.begin(); it != prepared.polled.end(); it++) {
+    (*it)->tree = tree;
+    addPolledDir(*it);
+  }
+
+  if (prepared.isLimitReached) {
+    limitWatchBudget();
+  }
+}
+
+// Keeps a copy of an event for the subscriptions that are being prepared. The copies are
+// bounded like the read queue: past that, they are dropped and the subscriptions re-scan
+// once they are registered, the same as after a kernel overflow.
+// Must be called with a lock on mMutex
+void InotifyBackend::bufferPendingEvent(struct inotify_event *event) {
+  size_t size = sizeof(*event) + event->len;
+  if (mPendingOverflowed || mPendingEvents.size() + size > mMaxQueuedBytes) {
+    if (!mPendingOverflowed) {
+      mPendingOverflowed = true;
+      std::vector<char>().swap(mPendingEvents);
+    }
+    return;
+  }
+
+  char *ptr = (char *)event;
+  mPendingEvents.insert(mPendingEvents.end(), ptr, ptr + size);
+}
+
+// Applies the events that arrived for the new watches while the subscription was being prepared.
+// Must be called with a lock on mMutex
+void InotifyBackend::replayPendingEvents(WatcherRef watcher, InotifyPreparedSubscription &prepared) {
+  std::unordered_set<int> wds;
+  for (auto it = prepared.watches.begin(); it != prepared.watches.end(); it++) {
+    wds.insert(it->first);
+  }
+
+  bool hasEvents = false;
+  struct inotify_event *event;
+  char *end = mPendingEvents.data() + mPendingEvents.size();
+  for (char *ptr = mPendingEvents.data(); ptr < end; ptr += sizeof(*event) + event->len) {
+    event = (struct inotify_event *)ptr;
+    if (wds.count(event->wd) == 0) {
+      continue;
+    }
+
+    auto found = mSubscriptions.find(event->wd);
+    if (found == mSubscriptions.end()) {
+      continue;
+    }
+
+    std::vector<std::shared_ptr<InotifySubscription>> subs = found->second;
+    for (auto it = subs.begin(); it != subs.end(); it++) {
+      if ((*it)->watcher == watcher && handleSubscription(event, *it)) {
+        hasEvents = true;
       }
     }
   }
+
+  if (hasEvents) {
+    watcher->notify();
+  }
 }
 
-bool InotifyBackend::watchDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree) {
-  int wd = inotify_add_watch(mInotify, path.c_str(), INOTIFY_MASK);
+bool InotifyBackend::watchDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, InotifyPreparedSubscription *prepared) {
+  // Watchers with pollingFallback poll the directories that don't fit in the watch budget.
+  // The root is always watched, so that we notice when it is deleted.
+  bool canPoll = watcher->mPollingFallback && path != watcher->mDir;
+  if (canPoll && (prepared ? prepared->watches.size() >= prepared->watchBudget : getRemainingWatches() == 0)) {
+    return pollDir(watcher, path, tree, prepared);
+  }
+
+  // Another watcher may already watch this directory with a different write mask, so add to it.
+  int wd = inotify_add_watch(mInotify, path.c_str(), INOTIFY_MASK | INOTIFY_WRITE_MASK(watcher) | IN_MASK_ADD);
   if (wd == -1) {
+    // Other processes share the limit, so it may be reached before the budget is used up.
+    if (canPoll && errno == ENOSPC) {
+      if (prepared) {
+        prepared->watchBudget = prepared->watches.size();
+        prepared->isLimitReached = true;
+      } else {
+        limitWatchBudget();
+      }
+
+      return pollDir(watcher, path, tree, prepared);
+    }
+
     return false;
   }
 
+  // Subscriptions that are still being prepared are registered later, under the lock.
+  if (prepared) {
+    prepared->watches.emplace_back(wd, path);
+    return true;
+  }
+
   std::shared_ptr<InotifySubscription> sub = std::make_shared<InotifySubscription>();
   sub->tree = tree;
   sub->path = path;
   sub->watcher = watcher;
-  mSubscriptions.emplace(wd, sub);
+  sub->wd = wd;
+  addSubscription(sub);
 
   return true;
 }
 
-void InotifyBackend::handleEvents() {
-  char buf[BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));;
-  struct inotify_event *event;
+// Adds the contents of a directory to the tree. Sub-directories are watched before they are read,
+// so that entries created in the meantime are either found by the crawl or reported by inotify.
+// For directories that appeared after the initial crawl, a create event is emitted for each entry.
+// Takes ownership of fd.
+void InotifyBackend::crawlDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, int fd, InotifyPreparedSubscription *prepared) {
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return;
+  }
 
-  // Track all of the watchers that are touched so we can notify them at the end of the events.
-  std::unordered_set<WatcherRef> watchers;
+  while (struct dirent *ent = readdir(dir)) {
+    if (ISDOT(ent->d_name)) {
+      continue;
+    }
+
+    std::string fullPath = path + "/" + ent->d_name;
+    if (watcher->isIgnored(fullPath)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    bool isDir = S_ISDIR(st.st_mode);
+    if (!isDir && !watcher->isIncluded(fullPath)) {
+      continue;
+    }
+
+    if (isDir && !watchDir(watcher, fullPath, tree, prepared)) {
+      // Directories that were deleted while crawling are fine, but running out of watches is not.
+      if (prepared && errno != ENOENT) {
+        std::string err = strerror(errno);
+        closedir(dir);
+        throw WatcherError(std::string("inotify_add_watch on '") + fullPath + std::string("' failed: ") + err, watcher);
+      }
+
+      continue;
+    }
+
+    if (!prepared) {
+      watcher->mEvents.create(fullPath);
+    } else if (isDir) {
+      prepared->stats.directories++;
+    } else {
+      prepared->stats.files++;
+    }
+
+    tree->add(fullPath, CONVERT_TIME(st.st_mtim), isDir);
+
+    if (isDir) {
+      int childFd = openat(fd, ent->d_name, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+      if (childFd != -1) {
+        crawlDir(watcher, fullPath, tree, childFd, prepared);
+      }
+    }
+  }
+
+  closedir(dir);
+}
+
+void InotifyBackend::addSubscription(std::shared_ptr<InotifySubscription> sub) {
+  // inotify_add_watch returns the existing descriptor when a directory is watched again,
+  // e.g. when it is re-discovered during a resync. Avoid duplicating the subscription.
+  std::vector<std::shared_ptr<InotifySubscription>> &subs = mSubscriptions[sub->wd];
+  for (auto it = subs.begin(); it != subs.end(); it++) {
+    if ((*it)->watcher == sub->watcher && (*it)->path == sub->path) {
+      return;
+    }
+  }
+
+  if (subs.empty()) {
+    addWatch(sub->wd);
+  }
 
+  subs.push_back(sub);
+  mWatchDescriptors[sub->path] = sub->wd;
+  mWatcherDescriptors[sub->watcher].insert(sub->wd);
+}
+
+// Reads everything the kernel has queued and hands it to the processing thread.
+void InotifyBackend::readEvents() {
   while (true) {
-    int n = read(mInotify, &buf, BUFFER_SIZE);
+    // Size the buffer so that a single read drains the whole kernel queue.
+    int available = 0;
+    if (ioctl(mInotify, FIONREAD, &available) == -1 || available < BUFFER_SIZE) {
+      available = BUFFER_SIZE;
+    }
+
+    std::vector<char> buf;
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      if (!mSpareBuffers.empty()) {
+        buf = std::move(mSpareBuffers.back());
+        mSpareBuffers.pop_back();
+      }
+    }
+
+    buf.resize(available);
+    ssize_t n = read(mInotify, buf.data(), buf.size());
     if (n < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         break;
@@ -114,14 +566,137 @@ void InotifyBackend::handleEvents() {
       break;
     }
 
-    for (char *ptr = buf; ptr < buf + n; ptr += sizeof(*event) + event->len) {
+    buf.resize(n);
+
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      if (mQueuedBytes + n > mMaxQueuedBytes) {
+        // The processing thread is too far behind. Drop the events and re-scan instead.
+        mQueueOverflowed = true;
+        if (mSpareBuffers.size() < MAX_SPARE_BUFFERS) {
+          mSpareBuffers.push_back(std::move(buf));
+        }
+      } else {
+        mQueuedBytes += n;
+        mQueue.push_back(std::move(buf));
+      }
+    }
+
+    mQueueCondition.notify_one();
+  }
+}
+
+void InotifyBackend::processEvents() {
+  std::deque<std::vector<char>> buffers;
+
+  while (true) {
+    bool overflowed;
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      mQueueCondition.wait(lock, [this] {
+        return !mQueue.empty() || mQueueOverflowed || mQueueStopped;
+      });
+
+      if (mQueueStopped) {
+        return;
+      }
+
+      // Take everything that has been read so far, so that watchers are notified once per batch.
+      buffers.swap(mQueue);
+      mQueuedBytes = 0;
+      overflowed = mQueueOverflowed;
+      mQueueOverflowed = false;
+    }
+
+    handleEvents(buffers, overflowed);
+
+    {
+      std::unique_lock<std::mutex> lock(mQueueMutex);
+      while (!buffers.empty() && mSpareBuffers.size() < MAX_SPARE_BUFFERS) {
+        mSpareBuffers.push_back(std::move(buffers.front()));
+        buffers.pop_front();
+      }
+    }
+
+    buffers.clear();
+  }
+}
+
+void InotifyBackend::stopProcessing() {
+  {
+    std::unique_lock<std::mutex> lock(mQueueMutex);
+    mQueueStopped = true;
+  }
+
+  mQueueCondition.notify_one();
+  if (mProcessorThread.joinable()) {
+    mProcessorThread.join();
+  }
+}
+
+void InotifyBackend::handleEvents(std::deque<std::vector<char>> &buffers, bool overflowed) {
+  struct inotify_event *event;
+
+  // Track all of the watchers that are touched so we can notify them at the end of the events.
+  std::unordered_set<WatcherRef> watchers;
+
+  for (auto it = buffers.begin(); it != buffers.end(); it++) {
+    // Each read buffer is handled under a single lock.
+    std::unique_lock<std::mutex> lock(mMutex);
+    mLastMasks.clear();
+
+    char *buf = it->data();
+    char *end = buf + it->size();
+    for (char *ptr = buf; ptr < end; ptr += sizeof(*event) + event->len) {
       event = (struct inotify_event *)ptr;
 
       if ((event->mask & IN_Q_OVERFLOW) == IN_Q_OVERFLOW) {
-        // overflow
+        // The kernel dropped events, so we can no longer trust the trees.
+        // Keep handling the rest, and re-scan once this batch is done.
+        overflowed = true;
+        if (mPendingSubscriptions > 0) {
+          mPendingOverflowed = true;
+        }
+        continue;
+      }
+
+      // Keep a copy for subscriptions that are still being prepared. Their watches already
+      // produce events, but they can only be handled once the subscription is registered.
+      if (mPendingSubscriptions > 0) {
+        bufferPendingEvent(event);
+      }
+
+      // Repeated modifications of the same file only need to be handled once per batch.
+      // The file is stat'ed after the whole buffer was read, so the first stat already
+      // sees the latest mtime. Anything else in between (e.g. a delete) breaks the run.
+      InotifyEventKey key = {event->wd, std::string_view(event->len > 0 ? event->name : "")};
+      uint32_t &lastMask = mLastMasks[key];
+      bool isUpdate = !(event->mask & ~(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_ISDIR));
+      bool isRepeated = lastMask == event->mask;
+      lastMask = event->mask;
+      if (isUpdate && isRepeated) {
         continue;
       }
 
+      // A rename is reported as a pair of events with the same cookie. The kernel queues
+      // them together, so only the next event has to be checked. If the pair got split
+      // across reads, it is handled as a delete and a create instead.
+      if ((event->mask & IN_MOVED_FROM) && event->cookie != 0) {
+        char *next = ptr + sizeof(*event) + event->len;
+        struct inotify_event *to = (struct inotify_event *)next;
+        if (next < end && (to->mask & IN_MOVED_TO) && to->cookie == event->cookie) {
+          if (mPendingSubscriptions > 0) {
+            bufferPendingEvent(to);
+          }
+
+          handleRename(event, to, watchers);
+          mLastMasks[{to->wd, std::string_view(to->len > 0 ? to->name : "")}] = to->mask;
+          ptr = next;
+          event = to;
+          continue;
+        }
+      }
+
       handleEvent(event, watchers);
     }
   }
@@ -129,23 +704,36 @@ void InotifyBackend::handleEvents() {
   for (auto it = watchers.begin(); it != watchers.end(); it++) {
     (*it)->notify();
   }
+
+  if (overflowed) {
+    requestResync();
+  }
 }
 
+// Called from handleEvents, which holds a lock on mMutex
 void InotifyBackend::handleEvent(struct inotify_event *event, std::unordered_set<WatcherRef> &watchers) {
-  std::unique_lock<std::mutex> lock(mMutex);
+  // Find the subscriptions for this watch descriptor. They are copied because
+  // handling an event can add or remove subscriptions.
+  auto found = mSubscriptions.find(event->wd);
+  if (found == mSubscriptions.end()) {
+    return;
+  }
 
-  // Find the subscriptions for this watch descriptor
-  auto range = mSubscriptions.equal_range(event->wd);
-  std::unordered_set<std::shared_ptr<InotifySubscription>> set;
-  for (auto it = range.first; it != range.second; it++) {
-    set.insert(it->second);
+  // Activity decides which directories keep their watch once some have to be polled.
+  if (!mPolledDirs.empty()) {
+    mWatchActivity[event->wd]++;
+    touchWatch(event->wd);
   }
 
-  for (auto it = set.begin(); it != set.end(); it++) {
+  mMatchingSubscriptions.assign(found->second.begin(), found->second.end());
+
+  for (auto it = mMatchingSubscriptions.begin(); it != mMatchingSubscriptions.end(); it++) {
     if (handleSubscription(event, *it)) {
       watchers.insert((*it)->watcher);
     }
   }
+
+  mMatchingSubscriptions.clear();
 }
 
 bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared_ptr<InotifySubscription> sub) {
@@ -162,6 +750,17 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
     return false;
   }
 
+  // The watch may carry both write masks when it is shared, so drop the one this watcher didn't ask for.
+  if ((event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) && !(event->mask & INOTIFY_WRITE_MASK(watcher))) {
+    return false;
+  }
+
+  // Files that don't match the include patterns are never added to the tree,
+  // so skip them before doing any syscalls.
+  if (!isDir && !(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && !watcher->isIncluded(path)) {
+    return false;
+  }
+
   // If this is a create, check if it's a directory and start watching if it is.
   // In any case, keep the directory tree up to date.
   if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
@@ -181,15 +780,19 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
         sub->tree->remove(path);
         return false;
       }
-    }
-  } else if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
-    watcher->mEvents.update(path);
 
-    struct stat st;
-    if (stat(path.c_str(), &st) != 0) {
-      return false;
+      // The directory may have been moved in, or filled before the watch was added
+      // (e.g. by extracting an archive), so pick up everything that is already inside.
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+      if (fd != -1) {
+        crawlDir(watcher, path, sub->tree, fd, nullptr);
+      }
     }
-    sub->tree->update(path, CONVERT_TIME(st.st_mtim));
+  } else if (event->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) {
+    // Only the mtime changes, and it is only read when writing a snapshot or diffing against one.
+    // Defer the stat until then so that modifications don't cost a syscall each.
+    watcher->mEvents.update(path);
+    sub->tree->markDirty(path);
   } else if (event->mask & (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVE_SELF)) {
     bool isSelfEvent = (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF));
     // Ignore delete/move self events unless this is the recursive watch root
@@ -197,16 +800,17 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
       return false;
     }
 
-    // If the entry being deleted/moved is a directory, remove it from the list of subscriptions
+    // If the entry being deleted/moved is a directory, remove it and everything below it from
+    // the list of subscriptions. Directories moved out of the root would otherwise keep
+    // reporting events under their old paths.
     // XXX: self events don't have the IN_ISDIR mask
     if (isSelfEvent || isDir) {
-      for (auto it = mSubscriptions.begin(); it != mSubscriptions.end();) {
-        if (it->second->path == path) {
-          it = mSubscriptions.erase(it);
-        } else {
-          ++it;
-        }
+      std::vector<std::string> dirs = sub->tree->findDirs(path);
+      for (auto it = dirs.begin(); it != dirs.end(); it++) {
+        removeSubscriptions(*it);
       }
+
+      removeSubscriptions(path);
     }
 
     watcher->mEvents.remove(path);
@@ -216,21 +820,875 @@ bool InotifyBackend::handleSubscription(struct inotify_event *event, std::shared
   return true;
 }
 
-// This function is called by Backend::unwatch which takes a lock on mMutex
-void InotifyBackend::unsubscribe(WatcherRef watcher) {
-  // Find any subscriptions pointing to this watcher, and remove them.
-  for (auto it = mSubscriptions.begin(); it != mSubscriptions.end();) {
-    if (it->second->watcher.get() == watcher.get()) {
-      if (mSubscriptions.count(it->first) == 1) {
-        int err = inotify_rm_watch(mInotify, it->first);
-        if (err == -1) {
-          throw WatcherError(std::string("Unable to remove watcher: ") + strerror(errno), watcher);
-        }
+// Called from handleEvents, which holds a lock on mMutex
+void InotifyBackend::handleRename(struct inotify_event *from, struct inotify_event *to, std::unordered_set<WatcherRef> &watchers) {
+  std::vector<std::shared_ptr<InotifySubscription>> fromSubs;
+  std::vector<std::shared_ptr<InotifySubscription>> toSubs;
+  auto found = mSubscriptions.find(from->wd);
+  if (found != mSubscriptions.end()) {
+    fromSubs = found->second;
+  }
+
+  found = mSubscriptions.find(to->wd);
+  if (found != mSubscriptions.end()) {
+    toSubs = found->second;
+  }
+
+  // Watchers that see both sides of the rename can move their subtree. For everyone else,
+  // the entry either left or entered the watched root.
+  for (auto it = fromSubs.begin(); it != fromSubs.end(); it++) {
+    std::shared_ptr<InotifySubscription> toSub;
+    for (auto sub = toSubs.begin(); sub != toSubs.end(); sub++) {
+      if ((*sub)->watcher == (*it)->watcher) {
+        toSub = *sub;
+        toSubs.erase(sub);
+        break;
       }
+    }
 
-      it = mSubscriptions.erase(it);
-    } else {
-      it++;
+    if (toSub && renameSubscription(from, *it, to, toSub)) {
+      watchers.insert((*it)->watcher);
+      continue;
+    }
+
+    if (handleSubscription(from, *it)) {
+      watchers.insert((*it)->watcher);
+    }
+
+    if (toSub && handleSubscription(to, toSub)) {
+      watchers.insert(toSub->watcher);
+    }
+  }
+
+  for (auto it = toSubs.begin(); it != toSubs.end(); it++) {
+    if (handleSubscription(to, *it)) {
+      watchers.insert((*it)->watcher);
     }
   }
 }
+
+// Moves an entry within a watcher's tree without touching the file system. Watch descriptors
+// follow the inode, so the watches for a renamed directory and its sub-directories stay valid,
+// and only their paths need to be updated. Returns false if the rename has to be handled as a
+// delete and a create instead.
+bool InotifyBackend::renameSubscription(struct inotify_event *from, std::shared_ptr<InotifySubscription> fromSub, struct inotify_event *to, std::shared_ptr<InotifySubscription> toSub) {
+  WatcherRef watcher = fromSub->watcher;
+  std::shared_ptr<DirTree> tree = fromSub->tree;
+  std::string fromPath = fromSub->path + "/" + std::string(from->name);
+  std::string toPath = toSub->path + "/" + std::string(to->name);
+  bool isDir = from->mask & IN_ISDIR;
+
+  if (tree != toSub->tree || watcher->isIgnored(fromPath) || watcher->isIgnored(toPath)) {
+    return false;
+  }
+
+  if (!isDir && (!watcher->isIncluded(fromPath) || !watcher->isIncluded(toPath))) {
+    return false;
+  }
+
+  // Ignore and include rules can apply differently to the contents under the new path.
+  bool hasRules = isDir && (watcher->mIgnoreGlobs.size() > 0 || watcher->mIncludeGlobs.size() > 0);
+  if (isDir && !hasRules) {
+    std::string fromStart = fromPath + "/";
+    std::string toStart = toPath + "/";
+    for (auto it = watcher->mIgnorePaths.begin(); !hasRules && it != watcher->mIgnorePaths.end(); it++) {
+      hasRules = it->rfind(fromStart, 0) == 0 || it->rfind(toStart, 0) == 0;
+    }
+
+    for (auto it = watcher->mIncludeDirs.begin(); !hasRules && it != watcher->mIncludeDirs.end(); it++) {
+      hasRules = it->rfind(fromStart, 0) == 0 || it->rfind(toStart, 0) == 0;
+    }
+  }
+
+  // Trees are shared between watchers with the same root, so another watcher may have moved it already.
+  if (!tree->rename(fromPath, toPath) && !tree->find(toPath)) {
+    return false;
+  }
+
+  if (isDir) {
+    std::vector<std::string> dirs = tree->findDirs(toPath);
+    for (auto it = dirs.begin(); it != dirs.end(); it++) {
+      moveSubscription(watcher, fromPath + it->substr(toPath.size()), *it);
+    }
+  }
+
+  // There is no rename event type, so consumers see the entry move as a delete and a create.
+  watcher->mEvents.remove(fromPath);
+  watcher->mEvents.create(toPath);
+
+  if (hasRules) {
+    int fd = open(toPath.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+    if (fd != -1) {
+      revealRenamed(watcher, fromPath, toPath, tree, fd);
+    }
+  }
+
+  return true;
+}
+
+// Walks a directory that was renamed within the root, and adds the entries that the watcher's
+// rules hid under the old path but not under the new one, with a create event for each, as if
+// they were moved in. Entries that are only hidden under the new path keep their watches, and
+// their events are dropped by isIgnored. Takes ownership of fd.
+void InotifyBackend::revealRenamed(WatcherRef watcher, std::string from, std::string to, std::shared_ptr<DirTree> tree, int fd) {
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return;
+  }
+
+  while (struct dirent *ent = readdir(dir)) {
+    if (ISDOT(ent->d_name)) {
+      continue;
+    }
+
+    std::string fromChild = from + "/" + ent->d_name;
+    std::string toChild = to + "/" + ent->d_name;
+    if (watcher->isIgnored(toChild)) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    bool isDir = S_ISDIR(st.st_mode);
+    if (!isDir && !watcher->isIncluded(toChild)) {
+      continue;
+    }
+
+    bool wasVisible = !watcher->isIgnored(fromChild) && (isDir || watcher->isIncluded(fromChild));
+    if (wasVisible && !isDir) {
+      continue;
+    }
+
+    if (!wasVisible && isDir && !watchDir(watcher, toChild, tree)) {
+      continue;
+    }
+
+    if (!wasVisible) {
+      watcher->mEvents.create(toChild);
+      tree->add(toChild, CONVERT_TIME(st.st_mtim), isDir);
+    }
+
+    if (isDir) {
+      int childFd = openat(fd, ent->d_name, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+      if (childFd == -1) {
+        continue;
+      }
+
+      if (wasVisible) {
+        revealRenamed(watcher, fromChild, toChild, tree, childFd);
+      } else {
+        crawlDir(watcher, toChild, tree, childFd, nullptr);
+      }
+    }
+  }
+
+  closedir(dir);
+}
+
+void InotifyBackend::moveSubscription(WatcherRef watcher, std::string from, std::string to) {
+  movePolledDirs(watcher, from, to);
+
+  auto found = mWatchDescriptors.find(from);
+  if (found == mWatchDescriptors.end()) {
+    return;
+  }
+
+  int wd = found->second;
+  auto subs = mSubscriptions.find(wd);
+  if (subs == mSubscriptions.end()) {
+    return;
+  }
+
+  bool isShared = false;
+  for (auto it = subs->second.begin(); it != subs->second.end(); it++) {
+    if ((*it)->path == from) {
+      if ((*it)->watcher == watcher) {
+        (*it)->path = to;
+      } else {
+        isShared = true;
+      }
+    }
+  }
+
+  if (!isShared) {
+    mWatchDescriptors.erase(found);
+  }
+
+  mWatchDescriptors[to] = wd;
+}
+
+void InotifyBackend::removeSubscriptions(std::string path) {
+  removePolledDirs(path);
+
+  auto found = mWatchDescriptors.find(path);
+  if (found == mWatchDescriptors.end()) {
+    return;
+  }
+
+  int wd = found->second;
+  mWatchDescriptors.erase(found);
+
+  auto subs = mSubscriptions.find(wd);
+  if (subs == mSubscriptions.end()) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<InotifySubscription>> removed;
+  for (auto it = subs->second.begin(); it != subs->second.end(); it++) {
+    if ((*it)->path == path) {
+      removed.push_back(*it);
+    }
+  }
+
+  for (auto it = removed.begin(); it != removed.end(); it++) {
+    removeSubscription(subs->second, *it);
+  }
+
+  // Directories that were moved out of the root are still watched by the kernel. Errors are
+  // expected for deleted directories, whose watches the kernel has already removed.
+  if (subs->second.empty()) {
+    mSubscriptions.erase(subs);
+    removeWatch(wd);
+    inotify_rm_watch(mInotify, wd);
+  }
+}
+
+// Removes a subscription from the list for its watch descriptor, and from the watcher index
+// once the watcher has no other subscriptions on that descriptor.
+void InotifyBackend::removeSubscription(std::vector<std::shared_ptr<InotifySubscription>> &subs, std::shared_ptr<InotifySubscription> sub) {
+  bool isShared = false;
+  for (auto it = subs.begin(); it != subs.end();) {
+    if (*it == sub) {
+      it = subs.erase(it);
+    } else {
+      if ((*it)->watcher == sub->watcher) {
+        isShared = true;
+      }
+      it++;
+    }
+  }
+
+  if (isShared) {
+    return;
+  }
+
+  auto found = mWatcherDescriptors.find(sub->watcher);
+  if (found != mWatcherDescriptors.end()) {
+    found->second.erase(sub->wd);
+    if (found->second.empty()) {
+      mWatcherDescriptors.erase(found);
+    }
+  }
+}
+
+// Called from the processing thread when the kernel queue overflowed. The re-scan happens on a
+// separate thread so that we keep reading events and don't overflow again in the meantime.
+void InotifyBackend::requestResync() {
+  std::unique_lock<std::mutex> lock(mResyncMutex);
+  mResyncRequested = true;
+  if (mResyncRunning || mResyncStopped) {
+    return;
+  }
+
+  if (mResyncThread.joinable()) {
+    mResyncThread.join();
+  }
+
+  mResyncRunning = true;
+  mResyncThread = std::thread([this] () {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mResyncMutex);
+        if (!mResyncRequested || mResyncStopped) {
+          mResyncRunning = false;
+          return;
+        }
+
+        mResyncRequested = false;
+      }
+
+      resync();
+    }
+  });
+}
+
+void InotifyBackend::stopResync() {
+  {
+    std::unique_lock<std::mutex> lock(mResyncMutex);
+    mResyncStopped = true;
+  }
+
+  if (mResyncThread.joinable()) {
+    mResyncThread.join();
+  }
+}
+
+void InotifyBackend::resync() {
+  std::unordered_map<WatcherRef, std::shared_ptr<DirTree>> trees;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (auto it = mWatcherDescriptors.begin(); it != mWatcherDescriptors.end(); it++) {
+      std::vector<std::shared_ptr<InotifySubscription>> &subs = mSubscriptions[*it->second.begin()];
+      for (auto sub = subs.begin(); sub != subs.end(); sub++) {
+        if ((*sub)->watcher == it->first) {
+          trees.emplace(it->first, (*sub)->tree);
+          break;
+        }
+      }
+    }
+  }
+
+  for (auto it = trees.begin(); it != trees.end(); it++) {
+    {
+      std::unique_lock<std::mutex> lock(mResyncMutex);
+      if (mResyncStopped) {
+        return;
+      }
+    }
+
+    try {
+      resyncTree(it->first, it->second);
+    } catch (WatcherError &err) {
+      handleWatcherError(err);
+    }
+  }
+}
+
+// Re-crawls the watched directory without holding the lock, then reconciles the result with
+// the in-memory tree. Events keep being processed during the crawl, so every difference is
+// confirmed with lstat before it is applied.
+void InotifyBackend::resyncTree(WatcherRef watcher, std::shared_ptr<DirTree> tree) {
+  std::shared_ptr<DirTree> fresh = std::make_shared<DirTree>(watcher->mDir);
+  readTree(watcher, fresh);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  // The watcher may have been unsubscribed while we were crawling.
+  if (mWatcherDescriptors.count(watcher) == 0) {
+    return;
+  }
+
+  refreshTree(tree);
+
+  std::vector<std::string> removed;
+  for (auto it = tree->entries.begin(); it != tree->entries.end(); it++) {
+    if (fresh->entries.count(it->first) == 0) {
+      removed.push_back(it->first);
+    }
+  }
+
+  struct stat st;
+  for (auto it = removed.begin(); it != removed.end(); it++) {
+    if (lstat(it->c_str(), &st) == 0) {
+      continue;
+    }
+
+    DirEntry *entry = tree->find(*it);
+    if (entry && entry->isDir) {
+      removeSubscriptions(*it);
+    }
+
+    watcher->mEvents.remove(*it);
+    tree->remove(*it);
+  }
+
+  for (auto it = fresh->entries.begin(); it != fresh->entries.end(); it++) {
+    DirEntry *entry = tree->find(it->first);
+    if (!entry) {
+      if (lstat(it->first.c_str(), &st) != 0) {
+        continue;
+      }
+
+      watcher->mEvents.create(it->first);
+      entry = tree->add(it->first, CONVERT_TIME(st.st_mtim), S_ISDIR(st.st_mode));
+      if (entry->isDir && !watchDir(watcher, it->first, tree)) {
+        tree->remove(it->first);
+      }
+    } else if (entry->mtime != it->second.mtime && !entry->isDir) {
+      if (lstat(it->first.c_str(), &st) != 0) {
+        continue;
+      }
+
+      watcher->mEvents.update(it->first);
+      tree->update(it->first, CONVERT_TIME(st.st_mtim));
+    }
+  }
+
+  // Let consumers know that events were lost and recovered, e.g. to invalidate caches.
+  watcher->mEvents.error("Events were dropped by the kernel. Changes were recovered by re-scanning the file system.");
+  lock.unlock();
+  watcher->notify();
+}
+
+// This function is called by Backend::unwatch which takes a lock on mMutex
+void InotifyBackend::unsubscribe(WatcherRef watcher) {
+  for (auto it = mPolledDirs.begin(); it != mPolledDirs.end();) {
+    std::vector<std::shared_ptr<InotifyPolledDir>> &dirs = it->second;
+    for (auto dir = dirs.begin(); dir != dirs.end();) {
+      if ((*dir)->watcher == watcher) {
+        (*dir)->isRemoved = true;
+        dir = dirs.erase(dir);
+      } else {
+        dir++;
+      }
+    }
+
+    it = dirs.empty() ? mPolledDirs.erase(it) : std::next(it);
+  }
+
+  auto found = mWatcherDescriptors.find(watcher);
+  if (found == mWatcherDescriptors.end()) {
+    return;
+  }
+
+  // Find any subscriptions pointing to this watcher, and remove them.
+  std::unordered_set<int> wds = std::move(found->second);
+  mWatcherDescriptors.erase(found);
+
+  for (auto wd = wds.begin(); wd != wds.end(); wd++) {
+    auto subs = mSubscriptions.find(*wd);
+    if (subs == mSubscriptions.end()) {
+      continue;
+    }
+
+    std::vector<std::shared_ptr<InotifySubscription>> &list = subs->second;
+    std::vector<std::string> paths;
+    for (auto it = list.begin(); it != list.end();) {
+      if ((*it)->watcher == watcher) {
+        paths.push_back((*it)->path);
+        it = list.erase(it);
+      } else {
+        it++;
+      }
+    }
+
+    // The watch itself is only removed once no other watcher uses it.
+    if (list.empty()) {
+      mSubscriptions.erase(subs);
+      removeWatch(*wd);
+      for (auto path = paths.begin(); path != paths.end(); path++) {
+        auto entry = mWatchDescriptors.find(*path);
+        if (entry != mWatchDescriptors.end() && entry->second == *wd) {
+          mWatchDescriptors.erase(entry);
+        }
+      }
+
+      int err = inotify_rm_watch(mInotify, *wd);
+      if (err == -1) {
+        throw WatcherError(std::string("Unable to remove watcher: ") + strerror(errno), watcher);
+      }
+    }
+  }
+}
+
+// Counts a new watch descriptor against the budget. Must be called with a lock on mMutex.
+void InotifyBackend::addWatch(int wd) {
+  {
+    std::unique_lock<std::mutex> lock(watchBudgetMutex);
+    watchCount++;
+  }
+
+  // New watches haven't had any events yet, so they start out as the coldest.
+  mWatchOrderIndex[wd] = mWatchOrder.insert(mWatchOrder.end(), wd);
+}
+
+// Must be called with a lock on mMutex.
+void InotifyBackend::removeWatch(int wd) {
+  {
+    std::unique_lock<std::mutex> lock(watchBudgetMutex);
+    watchCount--;
+  }
+
+  mWatchActivity.erase(wd);
+  auto found = mWatchOrderIndex.find(wd);
+  if (found != mWatchOrderIndex.end()) {
+    mWatchOrder.erase(found->second);
+    mWatchOrderIndex.erase(found);
+  }
+}
+
+// Moves a watch descriptor to the front of the order after an event. Must be called with a lock on mMutex.
+void InotifyBackend::touchWatch(int wd) {
+  auto found = mWatchOrderIndex.find(wd);
+  if (found != mWatchOrderIndex.end()) {
+    mWatchOrder.splice(mWatchOrder.begin(), mWatchOrder, found->second);
+  }
+}
+
+// Number of watches that can still be added for watchers with pollingFallback.
+size_t InotifyBackend::getRemainingWatches() {
+  std::unique_lock<std::mutex> lock(watchBudgetMutex);
+  return watchBudget > watchCount ? watchBudget - watchCount : 0;
+}
+
+// Polls a directory instead of watching it. The current entries are recorded, so that the
+// first poll can tell which of them were deleted.
+bool InotifyBackend::pollDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, InotifyPreparedSubscription *prepared) {
+  std::shared_ptr<InotifyPolledDir> dir = std::make_shared<InotifyPolledDir>();
+  dir->tree = tree;
+  dir->path = path;
+  dir->watcher = watcher;
+  dir->activity = 0;
+  dir->mtime = 0;
+  dir->skippedPolls = 0;
+  dir->isRemoved = false;
+
+  std::vector<InotifyPolledEntry> entries;
+  readPolledDir(watcher, path, entries);
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    dir->names.insert(it->name);
+  }
+
+  // Subscriptions that are still being prepared are registered later, under the lock.
+  if (prepared) {
+    prepared->polled.push_back(dir);
+  } else {
+    addPolledDir(dir);
+  }
+
+  return true;
+}
+
+void InotifyBackend::addPolledDir(std::shared_ptr<InotifyPolledDir> dir) {
+  std::vector<std::shared_ptr<InotifyPolledDir>> &dirs = mPolledDirs[dir->path];
+  for (auto it = dirs.begin(); it != dirs.end(); it++) {
+    if ((*it)->watcher == dir->watcher) {
+      return;
+    }
+  }
+
+  dirs.push_back(dir);
+  startPolling();
+}
+
+void InotifyBackend::removePolledDir(std::shared_ptr<InotifyPolledDir> dir) {
+  dir->isRemoved = true;
+  auto found = mPolledDirs.find(dir->path);
+  if (found == mPolledDirs.end()) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<InotifyPolledDir>> &dirs = found->second;
+  dirs.erase(std::remove(dirs.begin(), dirs.end(), dir), dirs.end());
+  if (dirs.empty()) {
+    mPolledDirs.erase(found);
+  }
+}
+
+void InotifyBackend::removePolledDirs(std::string path) {
+  auto found = mPolledDirs.find(path);
+  if (found == mPolledDirs.end()) {
+    return;
+  }
+
+  for (auto it = found->second.begin(); it != found->second.end(); it++) {
+    (*it)->isRemoved = true;
+  }
+
+  mPolledDirs.erase(found);
+}
+
+void InotifyBackend::movePolledDirs(WatcherRef watcher, std::string from, std::string to) {
+  auto found = mPolledDirs.find(from);
+  if (found == mPolledDirs.end()) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<InotifyPolledDir>> moved;
+  std::vector<std::shared_ptr<InotifyPolledDir>> &dirs = found->second;
+  for (auto it = dirs.begin(); it != dirs.end();) {
+    if ((*it)->watcher == watcher) {
+      (*it)->path = to;
+      moved.push_back(*it);
+      it = dirs.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  if (dirs.empty()) {
+    mPolledDirs.erase(found);
+  }
+
+  std::vector<std::shared_ptr<InotifyPolledDir>> &toDirs = mPolledDirs[to];
+  toDirs.insert(toDirs.end(), moved.begin(), moved.end());
+}
+
+// Called with a lock on mMutex. The poll thread runs until the backend stops.
+void InotifyBackend::startPolling() {
+  std::unique_lock<std::mutex> lock(mPollMutex);
+  if (mPollThread.joinable() || mPollStopped) {
+    return;
+  }
+
+  mPollThread = std::thread([this] () {
+    std::unique_lock<std::mutex> lock(mPollMutex);
+    while (!mPollStopped) {
+      mPollCondition.wait_for(lock, std::chrono::milliseconds(POLL_INTERVAL));
+      if (mPollStopped) {
+        break;
+      }
+
+      lock.unlock();
+      pollDirs();
+      lock.lock();
+    }
+  });
+}
+
+void InotifyBackend::stopPolling() {
+  {
+    std::unique_lock<std::mutex> lock(mPollMutex);
+    mPollStopped = true;
+  }
+
+  mPollCondition.notify_all();
+  if (mPollThread.joinable()) {
+    mPollThread.join();
+  }
+}
+
+bool InotifyBackend::isPollingStopped() {
+  std::unique_lock<std::mutex> lock(mPollMutex);
+  return mPollStopped;
+}
+
+// Reads the polled directories without holding the lock, then applies the differences
+// to the trees. Afterwards, the busiest polled directories are switched to inotify.
+void InotifyBackend::pollDirs() {
+  std::vector<std::shared_ptr<InotifyPolledDir>> dirs;
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (auto it = mPolledDirs.begin(); it != mPolledDirs.end(); it++) {
+      dirs.insert(dirs.end(), it->second.begin(), it->second.end());
+    }
+  }
+
+  std::unordered_set<WatcherRef> watchers;
+  std::vector<InotifyPolledEntry> entries;
+  struct stat st;
+  for (auto it = dirs.begin(); it != dirs.end(); it++) {
+    if (isPollingStopped()) {
+      return;
+    }
+
+    // Deleted directories are reported by the poll or the watch of their parent.
+    if (lstat((*it)->path.c_str(), &st) != 0) {
+      continue;
+    }
+
+    // Entries are only added, removed or renamed when the mtime of the directory changes, so
+    // unchanged directories are only read once in a while to find files that were written to.
+    // The mtime is taken before reading, so that changes made while reading aren't missed.
+    uint64_t mtime = CONVERT_TIME(st.st_mtim);
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      if ((*it)->mtime == mtime && ++(*it)->skippedPolls < FULL_POLL_INTERVAL) {
+        continue;
+      }
+    }
+
+    entries.clear();
+    if (!readPolledDir((*it)->watcher, (*it)->path, entries)) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    (*it)->mtime = mtime;
+    (*it)->skippedPolls = 0;
+    if (!(*it)->isRemoved && applyPoll(*it, entries)) {
+      watchers.insert((*it)->watcher);
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    balanceWatches(watchers);
+  }
+
+  for (auto it = watchers.begin(); it != watchers.end(); it++) {
+    (*it)->notify();
+  }
+}
+
+// Compares the entries of a polled directory with the tree, and emits events for the
+// differences. Returns whether anything changed. Must be called with a lock on mMutex.
+bool InotifyBackend::applyPoll(std::shared_ptr<InotifyPolledDir> dir, std::vector<InotifyPolledEntry> &entries) {
+  WatcherRef watcher = dir->watcher;
+  std::shared_ptr<DirTree> tree = dir->tree;
+  std::unordered_set<std::string> names;
+  size_t changes = 0;
+
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    names.insert(it->name);
+    std::string path = dir->path + "/" + it->name;
+    DirEntry *entry = tree->find(path);
+    if (!entry) {
+      watcher->mEvents.create(path);
+      tree->add(path, it->mtime, it->isDir);
+      changes++;
+
+      if (it->isDir) {
+        if (!watchDir(watcher, path, tree)) {
+          tree->remove(path);
+          continue;
+        }
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+        if (fd != -1) {
+          crawlDir(watcher, path, tree, fd, nullptr);
+        }
+      }
+    } else if (!entry->isDir && entry->mtime != it->mtime) {
+      watcher->mEvents.update(path);
+      tree->update(path, it->mtime);
+      changes++;
+    }
+  }
+
+  for (auto it = dir->names.begin(); it != dir->names.end(); it++) {
+    if (names.count(*it) > 0) {
+      continue;
+    }
+
+    std::string path = dir->path + "/" + *it;
+    DirEntry *entry = tree->find(path);
+    if (!entry) {
+      continue;
+    }
+
+    if (entry->isDir) {
+      std::vector<std::string> dirs = tree->findDirs(path);
+      for (auto d = dirs.begin(); d != dirs.end(); d++) {
+        removeSubscriptions(*d);
+      }
+    }
+
+    watcher->mEvents.remove(path);
+    tree->remove(path);
+    changes++;
+  }
+
+  dir->names = std::move(names);
+  dir->activity = dir->activity / 2 + changes;
+  return changes > 0;
+}
+
+// Switches the polled directories with the most changes to inotify, demoting watched
+// directories with fewer events once the budget is used up. Must be called with a lock on mMutex.
+void InotifyBackend::balanceWatches(std::unordered_set<WatcherRef> &watchers) {
+  for (auto it = mWatchActivity.begin(); it != mWatchActivity.end();) {
+    it->second /= 2;
+    it = it->second == 0 ? mWatchActivity.erase(it) : std::next(it);
+  }
+
+  std::vector<std::shared_ptr<InotifyPolledDir>> active;
+  for (auto it = mPolledDirs.begin(); it != mPolledDirs.end(); it++) {
+    for (auto dir = it->second.begin(); dir != it->second.end(); dir++) {
+      if ((*dir)->activity > 0) {
+        active.push_back(*dir);
+      }
+    }
+  }
+
+  std::sort(active.begin(), active.end(), [](const std::shared_ptr<InotifyPolledDir> &a, const std::shared_ptr<InotifyPolledDir> &b) {
+    return a->activity > b->activity;
+  });
+
+  if (active.size() > MAX_PROMOTIONS) {
+    active.resize(MAX_PROMOTIONS);
+  }
+
+  for (auto it = active.begin(); it != active.end(); it++) {
+    if ((*it)->isRemoved) {
+      continue;
+    }
+
+    if (getRemainingWatches() == 0 && !demoteWatch((*it)->activity)) {
+      break;
+    }
+
+    if (!promoteDir(*it, watchers)) {
+      break;
+    }
+  }
+}
+
+// Watches a polled directory. It is polled one last time once the watch is added,
+// so that nothing that changed since the previous poll is missed.
+bool InotifyBackend::promoteDir(std::shared_ptr<InotifyPolledDir> dir, std::unordered_set<WatcherRef> &watchers) {
+  WatcherRef watcher = dir->watcher;
+  int wd = inotify_add_watch(mInotify, dir->path.c_str(), INOTIFY_MASK | INOTIFY_WRITE_MASK(watcher) | IN_MASK_ADD);
+  if (wd == -1) {
+    if (errno == ENOSPC) {
+      limitWatchBudget();
+    }
+
+    return false;
+  }
+
+  std::shared_ptr<InotifySubscription> sub = std::make_shared<InotifySubscription>();
+  sub->tree = dir->tree;
+  sub->path = dir->path;
+  sub->watcher = watcher;
+  sub->wd = wd;
+  addSubscription(sub);
+  mWatchActivity[wd] = dir->activity;
+  removePolledDir(dir);
+
+  std::vector<InotifyPolledEntry> entries;
+  if (readPolledDir(watcher, dir->path, entries) && applyPoll(dir, entries)) {
+    watchers.insert(watcher);
+  }
+
+  return true;
+}
+
+// Polls the watched directory that went the longest without events, if it had fewer than the given
+// activity and is only used by watchers with pollingFallback. Must be called with a lock on mMutex.
+bool InotifyBackend::demoteWatch(size_t activity) {
+  // Watches that can't be polled are moved to the front, so that they aren't checked again
+  // on every demotion. Their position only matters once they can be polled.
+  int coldest = -1;
+  for (size_t checked = 0, count = mWatchOrder.size(); checked < count; checked++) {
+    int wd = mWatchOrder.back();
+    bool canPoll = true;
+    std::vector<std::shared_ptr<InotifySubscription>> &subs = mSubscriptions[wd];
+    for (auto sub = subs.begin(); sub != subs.end(); sub++) {
+      if (!(*sub)->watcher->mPollingFallback || (*sub)->path == (*sub)->watcher->mDir) {
+        canPoll = false;
+        break;
+      }
+    }
+
+    if (canPoll) {
+      auto found = mWatchActivity.find(wd);
+      if (found == mWatchActivity.end() || found->second < activity) {
+        coldest = wd;
+      }
+
+      break;
+    }
+
+    touchWatch(wd);
+  }
+
+  if (coldest == -1) {
+    return false;
+  }
+
+  std::vector<std::shared_ptr<InotifySubscription>> subs = mSubscriptions[coldest];
+  for (auto it = subs.begin(); it != subs.end(); it++) {
+    // Entries modified while watched only have their mtime refreshed lazily, and the poller
+    // compares mtimes, so refresh them first to avoid reporting those changes twice.
+    refreshTree((*it)->tree);
+    removeSubscriptions((*it)->path);
+    pollDir((*it)->watcher, (*it)->path, (*it)->tree, nullptr);
+  }
+
+  return true;
+}
@@ -2,33 +2,181 @@
 #define INOTIFY_H
 
 #include <unordered_map>
+#include <deque>
+#include <list>
+#include <condition_variable>
+#include <string_view>
 #include <sys/inotify.h>
 #include "../shared/BruteForceBackend.hh"
 #include "../DirTree.hh"
-#include "../Signal.hh"
 
 struct InotifySubscription {
   std::shared_ptr<DirTree> tree;
   std::string path;
   WatcherRef watcher;
+  int wd;
+};
+
+// A directory of a watcher with pollingFallback that is polled instead of watched,
+// because it didn't fit in the inotify watch limit.
+struct InotifyPolledDir {
+  std::shared_ptr<DirTree> tree;
+  std::string path;
+  WatcherRef watcher;
+  // Names found by the last poll, to detect deletions.
+  std::unordered_set<std::string> names;
+  // Changes found by recent polls. Halved on every poll.
+  size_t activity;
+  // The directory's mtime when its entries were last read, and the polls skipped since.
+  uint64_t mtime;
+  size_t skippedPolls;
+  bool isRemoved;
+};
+
+struct InotifyPolledEntry {
+  std::string name;
+  uint64_t mtime;
+  bool isDir;
+};
+
+// Identifies the file an event refers to within a single read buffer.
+// The name points into the buffer, so keys must not outlive it.
+struct InotifyEventKey {
+  int wd;
+  std::string_view name;
+
+  bool operator==(const InotifyEventKey &other) const {
+    return wd == other.wd && name == other.name;
+  }
+};
+
+namespace std
+{
+  template <>
+  struct hash<InotifyEventKey>
+  {
+    size_t operator()(const InotifyEventKey &key) const {
+      return hash<std::string_view>()(key.name) ^ ((size_t)key.wd * 31);
+    }
+  };
+}
+
+// Watches added for a subscription before it is registered.
+class InotifyPreparedSubscription : public PreparedSubscription {
+public:
+  // The crawled tree, unless the cached tree was already complete.
+  std::shared_ptr<DirTree> tree;
+  std::vector<std::pair<int, std::string>> watches;
+  std::vector<std::shared_ptr<InotifyPolledDir>> polled;
+  // Number of watches that may be added for watchers with pollingFallback.
+  size_t watchBudget = SIZE_MAX;
+  bool isLimitReached = false;
 };
 
 class InotifyBackend : public BruteForceBackend {
 public:
+  InotifyBackend() : mInotify(-1), mMaxQueuedBytes(0), mQueuedBytes(0), mQueueOverflowed(false), mQueueStopped(false), mPendingSubscriptions(0), mPendingOverflowed(false), mResyncRequested(false), mResyncRunning(false), mResyncStopped(false), mPollStopped(false) {}
   void start() override;
   ~InotifyBackend();
+  void writeSnapshot(WatcherRef watcher, std::string *snapshotPath) override;
+  void getEventsSince(WatcherRef watcher, std::string *snapshotPath) override;
   void subscribe(WatcherRef watcher) override;
   void unsubscribe(WatcherRef watcher) override;
+  std::shared_ptr<PreparedSubscription> prepareSubscribe(WatcherRef watcher) override;
+  ScanStats completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) override;
+  void cancelSubscribe(std::shared_ptr<PreparedSubscription> prepared) override;
 private:
-  int mPipe[2];
   int mInotify;
-  std::unordered_multimap<int, std::shared_ptr<InotifySubscription>> mSubscriptions;
-  Signal mEndedSignal;
+  // Subscriptions by watch descriptor, plus indexes so that removing a directory or a watcher
+  // only touches the affected watches. Several watchers can share a watch descriptor.
+  std::unordered_map<int, std::vector<std::shared_ptr<InotifySubscription>>> mSubscriptions;
+  std::unordered_map<std::string, int> mWatchDescriptors;
+  std::unordered_map<WatcherRef, std::unordered_set<int>> mWatcherDescriptors;
+
+  // Raw event buffers handed from the event loop to the processing thread.
+  std::mutex mQueueMutex;
+  std::condition_variable mQueueCondition;
+  std::deque<std::vector<char>> mQueue;
+  std::vector<std::vector<char>> mSpareBuffers;
+  std::thread mProcessorThread;
+  size_t mMaxQueuedBytes;
+  size_t mQueuedBytes;
+  bool mQueueOverflowed;
+  bool mQueueStopped;
+
+  // Raw events received while subscriptions are being prepared, replayed once they are registered.
+  size_t mPendingSubscriptions;
+  std::vector<char> mPendingEvents;
+  bool mPendingOverflowed;
+
+  // Scratch containers reused across batches by the processing thread.
+  std::unordered_map<InotifyEventKey, uint32_t> mLastMasks;
+  std::vector<std::shared_ptr<InotifySubscription>> mMatchingSubscriptions;
+
+  // Resynchronization after the kernel queue overflows, run on its own thread.
+  std::mutex mResyncMutex;
+  std::thread mResyncThread;
+  bool mResyncRequested;
+  bool mResyncRunning;
+  bool mResyncStopped;
+
+  // Directories that are polled once the watch budget is used up, keyed by path, and the
+  // number of recent events for each watch descriptor, used to pick which ones to watch.
+  // Watch descriptors are also kept in the order of their latest event, most recent first,
+  // so that the coldest ones are found without going through all of them.
+  std::unordered_map<std::string, std::vector<std::shared_ptr<InotifyPolledDir>>> mPolledDirs;
+  std::unordered_map<int, size_t> mWatchActivity;
+  std::list<int> mWatchOrder;
+  std::unordered_map<int, std::list<int>::iterator> mWatchOrderIndex;
+  std::mutex mPollMutex;
+  std::condition_variable mPollCondition;
+  std::thread mPollThread;
+  bool mPollStopped;
 
-  bool watchDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree);
-  void handleEvents();
+  bool watchDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, InotifyPreparedSubscription *prepared = nullptr);
+  void addWatches(WatcherRef watcher, InotifyPreparedSubscription &prepared, std::vector<std::string> *dirs);
+  void crawlTree(WatcherRef watcher, InotifyPreparedSubscription &prepared);
+  void crawlDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, int fd, InotifyPreparedSubscription *prepared);
+  bool getWatchedDirs(WatcherRef watcher, std::vector<std::string> &dirs);
+  void registerSubscription(WatcherRef watcher, InotifyPreparedSubscription &prepared);
+  void bufferPendingEvent(struct inotify_event *event);
+  void replayPendingEvents(WatcherRef watcher, InotifyPreparedSubscription &prepared);
+  void finishPending();
+  void readEvents();
+  void processEvents();
+  void stopProcessing();
+  void handleEvents(std::deque<std::vector<char>> &buffers, bool overflowed);
   void handleEvent(struct inotify_event *event, std::unordered_set<WatcherRef> &watchers);
   bool handleSubscription(struct inotify_event *event, std::shared_ptr<InotifySubscription> sub);
+  void handleRename(struct inotify_event *from, struct inotify_event *to, std::unordered_set<WatcherRef> &watchers);
+  bool renameSubscription(struct inotify_event *from, std::shared_ptr<InotifySubscription> fromSub, struct inotify_event *to, std::shared_ptr<InotifySubscription> toSub);
+  void revealRenamed(WatcherRef watcher, std::string from, std::string to, std::shared_ptr<DirTree> tree, int fd);
+  void moveSubscription(WatcherRef watcher, std::string from, std::string to);
+  void requestResync();
+  void stopResync();
+  void resync();
+  void resyncTree(WatcherRef watcher, std::shared_ptr<DirTree> tree);
+  void addSubscription(std::shared_ptr<InotifySubscription> sub);
+  void refreshTree(std::shared_ptr<DirTree> tree);
+  void removeSubscriptions(std::string path);
+  void removeSubscription(std::vector<std::shared_ptr<InotifySubscription>> &subs, std::shared_ptr<InotifySubscription> sub);
+  void addWatch(int wd);
+  void removeWatch(int wd);
+  void touchWatch(int wd);
+  size_t getRemainingWatches();
+  bool pollDir(WatcherRef watcher, std::string path, std::shared_ptr<DirTree> tree, InotifyPreparedSubscription *prepared);
+  void addPolledDir(std::shared_ptr<InotifyPolledDir> dir);
+  void removePolledDir(std::shared_ptr<InotifyPolledDir> dir);
+  void removePolledDirs(std::string path);
+  void movePolledDirs(WatcherRef watcher, std::string from, std::string to);
+  void startPolling();
+  void stopPolling();
+  bool isPollingStopped();
+  void pollDirs();
+  bool applyPoll(std::shared_ptr<InotifyPolledDir> dir, std::vector<InotifyPolledEntry> &entries);
+  void balanceWatches(std::unordered_set<WatcherRef> &watchers);
+  bool promoteDir(std::shared_ptr<InotifyPolledDir> dir, std::unordered_set<WatcherRef> &watchers);
+  bool demoteWatch(size_t activity);
 };
 
 #endif
@@ -1,10 +1,34 @@
 #include <string>
+#include <vector>
+#include <algorithm>
 #include "../DirTree.hh"
 #include "../Event.hh"
 #include "./BruteForceBackend.hh"
 
+// Trees crawled with include patterns only contain part of the directory,
+// so they must not be shared with watchers that have different patterns.
+static std::string getTreeKey(WatcherRef watcher) {
+  std::vector<std::string> patterns;
+  for (auto it = watcher->mIncludeDirs.begin(); it != watcher->mIncludeDirs.end(); it++) {
+    patterns.push_back(*it);
+  }
+
+  for (auto it = watcher->mIncludeGlobs.begin(); it != watcher->mIncludeGlobs.end(); it++) {
+    patterns.push_back(it->mRaw);
+  }
+
+  std::sort(patterns.begin(), patterns.end());
+
+  std::string key;
+  for (auto it = patterns.begin(); it != patterns.end(); it++) {
+    key += '\0' + *it;
+  }
+
+  return key;
+}
+
 std::shared_ptr<DirTree> BruteForceBackend::getTree(WatcherRef watcher, bool shouldRead) {
-  auto tree = DirTree::getCached(watcher->mDir);
+  auto tree = DirTree::getCached(watcher->mDir, getTreeKey(watcher));
 
   // If the tree is not complete, read it if needed.
   if (!tree->isComplete && shouldRead) {
@@ -18,8 +18,8 @@ public:
   }
 
   std::shared_ptr<DirTree> getTree(WatcherRef watcher, bool shouldRead = true);
-private:
-  void readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree);
+protected:
+  void readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree, ScanStats *stats = nullptr);
 };
 
 #endif
@@ -16,7 +16,7 @@
 #define st_mtim st_mtimespec
 #endif
 
-void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree) {
+void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree, ScanStats *stats) {
   char *paths[2] {(char *)watcher->mDir.c_str(), NULL};
   FTS *fts = fts_open(paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
   if (!fts) {
@@ -42,7 +42,17 @@ void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tr
       continue;
     }
 
-    tree->add(node->fts_path, CONVERT_TIME(node->fts_statp->st_mtim), (node->fts_info & FTS_D) == FTS_D);
+    if (!(node->fts_info & FTS_D) && !watcher->isIncluded(std::string(node->fts_path))) {
+      continue;
+    }
+
+    bool isDir = (node->fts_info & FTS_D) == FTS_D;
+    tree->add(node->fts_path, CONVERT_TIME(node->fts_statp->st_mtim), isDir);
+    if (stats && isDir) {
+      stats->directories++;
+    } else if (stats) {
+      stats->files++;
+    }
     isRoot = false;
   }
 
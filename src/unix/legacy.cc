@@ -24,7 +24,7 @@
 #endif
 #define ISDOT(a) (a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
 
-void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const char *relative, int parent_fd, const std::string &dirname) {
+void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const char *relative, int parent_fd, const std::string &dirname, ScanStats *stats) {
     int open_flags = (O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
     int new_fd = openat(parent_fd, relative, open_flags);
     if (new_fd == -1) {
@@ -32,12 +32,19 @@ void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const
             return; // ignore insufficient permissions
         }
 
+        if (errno == ENOENT && dirname != watcher->mDir) {
+            return; // ignore directories deleted while crawling
+        }
+
         throw WatcherError(strerror(errno), watcher);
     }
 
     struct stat rootAttributes;
     fstatat(new_fd, ".", &rootAttributes, AT_SYMLINK_NOFOLLOW);
     tree->add(dirname, CONVERT_TIME(rootAttributes.st_mtim), true);
+    if (stats) {
+        stats->directories++;
+    }
 
     if (DIR *dir = fdopendir(new_fd)) {
         while (struct dirent *ent = (errno = 0, readdir(dir))) {
@@ -46,14 +53,18 @@ void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const
             std::string fullPath = dirname + "/" + ent->d_name;
 
             if (!watcher->isIgnored(fullPath)) {
-                struct stat attrib;
-                fstatat(new_fd, ent->d_name, &attrib, AT_SYMLINK_NOFOLLOW);
                 bool isDir = ent->d_type == DT_DIR;
 
                 if (isDir) {
-                    iterateDir(watcher, tree, ent->d_name, new_fd, fullPath);
-                } else {
+                    iterateDir(watcher, tree, ent->d_name, new_fd, fullPath, stats);
+                } else if (watcher->isIncluded(fullPath)) {
+                    // Only stat files that are kept. Directories are stat'ed by iterateDir.
+                    struct stat attrib;
+                    fstatat(new_fd, ent->d_name, &attrib, AT_SYMLINK_NOFOLLOW);
                     tree->add(fullPath, CONVERT_TIME(attrib.st_mtim), isDir);
+                    if (stats) {
+                        stats->files++;
+                    }
                 }
             }
         }
@@ -68,10 +79,10 @@ void iterateDir(WatcherRef watcher, const std::shared_ptr <DirTree> tree, const
     }
 }
 
-void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr <DirTree> tree) {
+void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr <DirTree> tree, ScanStats *stats) {
     int fd = open(watcher->mDir.c_str(), O_RDONLY);
     if (fd) {
-        iterateDir(watcher, tree, ".", fd, watcher->mDir);
+        iterateDir(watcher, tree, ".", fd, watcher->mDir, stats);
         close(fd);
     }
 }
@@ -0,0 +1,720 @@
+#include <algorithm>
+#include <cstring>
+#include "Regex.hh"
+
+#define MAX_REPEAT 1000
+#define MAX_PROGRAM_SIZE 100000
+#define MAX_CODE_POINT 0x10FFFF
+
+typedef std::vector<Regex::Inst> Fragment;
+typedef std::vector<Regex::Range> Ranges;
+
+struct RegexUnsupported {};
+
+static uint32_t decodeUtf8(const std::string &str, size_t pos, size_t &len) {
+  unsigned char c = str[pos];
+  size_t remaining = str.size() - pos;
+  if (c < 0x80) {
+    len = 1;
+    return c;
+  }
+
+  if ((c & 0xe0) == 0xc0 && remaining >= 2) {
+    len = 2;
+    return ((c & 0x1f) << 6) | (str[pos + 1] & 0x3f);
+  }
+
+  if ((c & 0xf0) == 0xe0 && remaining >= 3) {
+    len = 3;
+    return ((c & 0x0f) << 12) | ((str[pos + 1] & 0x3f) << 6) | (str[pos + 2] & 0x3f);
+  }
+
+  if ((c & 0xf8) == 0xf0 && remaining >= 4) {
+    len = 4;
+    return ((c & 0x07) << 18) | ((str[pos + 1] & 0x3f) << 12) | ((str[pos + 2] & 0x3f) << 6) | (str[pos + 3] & 0x3f);
+  }
+
+  // Invalid UTF-8, treat the byte as a single character.
+  len = 1;
+  return c;
+}
+
+static bool isLineTerminator(uint32_t c) {
+  return c == '\n' || c == '\r' || c == 0x2028 || c == 0x2029;
+}
+
+static void addDigits(Ranges &ranges) {
+  ranges.push_back({'0', '9'});
+}
+
+static void addWord(Ranges &ranges) {
+  ranges.push_back({'0', '9'});
+  ranges.push_back({'A', 'Z'});
+  ranges.push_back({'_', '_'});
+  ranges.push_back({'a', 'z'});
+}
+
+// Same set as JS \s.
+static void addSpace(Ranges &ranges) {
+  ranges.push_back({'\t', '\r'});
+  ranges.push_back({' ', ' '});
+  ranges.push_back({0xa0, 0xa0});
+  ranges.push_back({0x1680, 0x1680});
+  ranges.push_back({0x2000, 0x200a});
+  ranges.push_back({0x2028, 0x2029});
+  ranges.push_back({0x202f, 0x202f});
+  ranges.push_back({0x205f, 0x205f});
+  ranges.push_back({0x3000, 0x3000});
+  ranges.push_back({0xfeff, 0xfeff});
+}
+
+static void addComplement(Ranges &ranges, Ranges set) {
+  std::sort(set.begin(), set.end(), [] (const Regex::Range &a, const Regex::Range &b) {
+    return a.lo < b.lo;
+  });
+
+  uint32_t next = 0;
+  for (auto it = set.begin(); it != set.end(); it++) {
+    if (it->lo > next) {
+      ranges.push_back({next, it->lo - 1});
+    }
+
+    next = std::max(next, it->hi + 1);
+  }
+
+  if (next <= MAX_CODE_POINT) {
+    ranges.push_back({next, MAX_CODE_POINT});
+  }
+}
+
+// Adds the set for a \d, \w or \s style escape. Returns false if c is not one.
+static bool addClassEscape(Ranges &ranges, char c) {
+  Ranges set;
+  switch (c) {
+    case 'd': case 'D': addDigits(set); break;
+    case 'w': case 'W': addWord(set); break;
+    case 's': case 'S': addSpace(set); break;
+    default: return false;
+  }
+
+  if (c >= 'A' && c <= 'Z') {
+    addComplement(ranges, set);
+  } else {
+    ranges.insert(ranges.end(), set.begin(), set.end());
+  }
+
+  return true;
+}
+
+bool Regex::CharClass::contains(uint32_t c) const {
+  for (auto it = ranges.begin(); it != ranges.end(); it++) {
+    if (c >= it->lo && c <= it->hi) {
+      return !negate;
+    }
+  }
+
+  return negate;
+}
+
+class RegexCompiler {
+public:
+  RegexCompiler(const std::string &source, Regex &regex) : mSource(source), mPos(0), mRegex(regex), mLooks(0) {}
+
+  void compile() {
+    Fragment program;
+    parseAlternation(program);
+    if (mPos != mSource.size()) {
+      throw RegexUnsupported();
+    }
+
+    program.push_back({Regex::MATCH, false, 0, 0, 0});
+    mRegex.mProgram = std::move(program);
+  }
+
+private:
+  const std::string &mSource;
+  size_t mPos;
+  Regex &mRegex;
+  int mLooks;
+
+  bool done() {
+    return mPos >= mSource.size();
+  }
+
+  char peek(size_t offset = 0) {
+    return mPos + offset < mSource.size() ? mSource[mPos + offset] : '\0';
+  }
+
+  bool consume(const char *str) {
+    size_t len = strlen(str);
+    if (mSource.compare(mPos, len, str) == 0) {
+      mPos += len;
+      return true;
+    }
+
+    return false;
+  }
+
+  // Appends a fragment, relocating its jump targets.
+  void append(Fragment &out, const Fragment &frag) {
+    int delta = static_cast<int>(out.size());
+    for (auto it = frag.begin(); it != frag.end(); it++) {
+      Regex::Inst inst = *it;
+      if (inst.op == Regex::SPLIT || inst.op == Regex::JMP || inst.op == Regex::LOOK) {
+        inst.x += delta;
+      }
+
+      if (inst.op == Regex::SPLIT) {
+        inst.y += delta;
+      }
+
+      out.push_back(inst);
+    }
+
+    if (out.size() > MAX_PROGRAM_SIZE) {
+      throw RegexUnsupported();
+    }
+  }
+
+  void parseAlternation(Fragment &out) {
+    Fragment first;
+    parseSequence(first);
+    if (peek() != '|') {
+      append(out, first);
+      return;
+    }
+
+    mPos++;
+    Fragment rest;
+    parseAlternation(rest);
+
+    // SPLIT L1, L2; L1: first; JMP end; L2: rest; end:
+    int l2 = static_cast<int>(first.size()) + 2;
+    int end = l2 + static_cast<int>(rest.size());
+    Fragment frag;
+    frag.push_back({Regex::SPLIT, false, 0, 1, l2});
+    append(frag, first);
+    frag.push_back({Regex::JMP, false, 0, end, 0});
+    append(frag, rest);
+    append(out, frag);
+  }
+
+  void parseSequence(Fragment &out) {
+    while (!done() && peek() != '|' && peek() != ')') {
+      Fragment atom;
+      bool quantifiable = parseAtom(atom);
+      parseQuantifier(atom, quantifiable);
+      append(out, atom);
+    }
+  }
+
+  bool parseAtom(Fragment &out) {
+    char c = peek();
+    switch (c) {
+      case '^':
+        mPos++;
+        out.push_back({Regex::BOL, false, 0, 0, 0});
+        return false;
+      case '$':
+        mPos++;
+        out.push_back({Regex::EOL, false, 0, 0, 0});
+        return false;
+      case '.':
+        mPos++;
+        out.push_back({Regex::ANY, false, 0, 0, 0});
+        return true;
+      case '(':
+        return parseGroup(out);
+      case '[':
+        parseClass(out);
+        return true;
+      case '\\':
+        parseEscape(out);
+        return true;
+      case '*':
+      case '+':
+      case '?':
+        throw RegexUnsupported();
+      case '{': {
+        size_t start = mPos;
+        int min, max;
+        if (parseBraces(min, max)) {
+          throw RegexUnsupported();
+        }
+
+        mPos = start + 1;
+        out.push_back({Regex::CHAR, false, '{', 0, 0});
+        return true;
+      }
+      default: {
+        size_t len;
+        uint32_t cp = decodeUtf8(mSource, mPos, len);
+        mPos += len;
+        out.push_back({Regex::CHAR, false, cp, 0, 0});
+        return true;
+      }
+    }
+  }
+
+  bool parseGroup(Fragment &out) {
+    mPos++;
+
+    bool isLook = false;
+    bool negate = false;
+    if (consume("?:")) {
+      // Non-capturing group.
+    } else if (consume("?=")) {
+      isLook = true;
+    } else if (consume("?!")) {
+      isLook = true;
+      negate = true;
+    } else if (consume("?<=") || consume("?<!")) {
+      throw RegexUnsupported();
+    } else if (consume("?<")) {
+      // Named group. Captures are not needed for matching, so skip the name.
+      while (!done() && peek() != '>') {
+        mPos++;
+      }
+
+      if (!consume(">")) {
+        throw RegexUnsupported();
+      }
+    } else if (peek() == '?') {
+      throw RegexUnsupported();
+    }
+
+    Fragment inner;
+    parseAlternation(inner);
+    if (!consume(")")) {
+      throw RegexUnsupported();
+    }
+
+    if (!isLook) {
+      append(out, inner);
+      return true;
+    }
+
+    // LOOK end; inner; MATCH; end:
+    int end = static_cast<int>(inner.size()) + 2;
+    Fragment frag;
+    frag.push_back({Regex::LOOK, negate, 0, end, mLooks++});
+    append(frag, inner);
+    frag.push_back({Regex::MATCH, false, 0, 0, 0});
+    append(out, frag);
+    return false;
+  }
+
+  uint32_t parseHex(size_t digits) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < digits; i++) {
+      char c = peek();
+      uint32_t d;
+      if (c >= '0' && c <= '9') {
+        d = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        d = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        d = c - 'A' + 10;
+      } else {
+        throw RegexUnsupported();
+      }
+
+      value = value * 16 + d;
+      mPos++;
+    }
+
+    return value;
+  }
+
+  // Parses the character following a backslash that denotes a single code point.
+  uint32_t parseEscapedChar(bool inClass) {
+    char c = peek();
+    mPos++;
+    switch (c) {
+      case 'n': return '\n';
+      case 'r': return '\r';
+      case 't': return '\t';
+      case 'f': return '\f';
+      case 'v': return '\v';
+      case '0': return '\0';
+      case 'x': return parseHex(2);
+      case 'u': return parseHex(4);
+      case 'c': {
+        char l = peek();
+        if (!((l >= 'a' && l <= 'z') || (l >= 'A' && l <= 'Z'))) {
+          throw RegexUnsupported();
+        }
+
+        mPos++;
+        return l % 32;
+      }
+      case 'b':
+        if (inClass) {
+          return '\b';
+        }
+
+        throw RegexUnsupported();
+      case 'B':
+      case 'k':
+        throw RegexUnsupported();
+      default:
+        if (c >= '1' && c <= '9') {
+          // Backreference.
+          throw RegexUnsupported();
+        }
+
+        // Identity escape.
+        mPos--;
+        size_t len;
+        uint32_t cp = decodeUtf8(mSource, mPos, len);
+        mPos += len;
+        return cp;
+    }
+  }
+
+  void parseEscape(Fragment &out) {
+    mPos++;
+    if (done()) {
+      throw RegexUnsupported();
+    }
+
+    Regex::CharClass cls;
+    cls.negate = false;
+    if (addClassEscape(cls.ranges, peek())) {
+      mPos++;
+      out.push_back({Regex::CLASS, false, static_cast<uint32_t>(mRegex.mClasses.size()), 0, 0});
+      mRegex.mClasses.push_back(std::move(cls));
+      return;
+    }
+
+    out.push_back({Regex::CHAR, false, parseEscapedChar(false), 0, 0});
+  }
+
+  // Parses a single class atom. Returns false if it was a set such as \d.
+  bool parseClassAtom(Ranges &ranges, uint32_t &cp) {
+    if (peek() == '\\') {
+      mPos++;
+      if (done()) {
+        throw RegexUnsupported();
+      }
+
+      if (addClassEscape(ranges, peek())) {
+        mPos++;
+        return false;
+      }
+
+      cp = parseEscapedChar(true);
+      return true;
+    }
+
+    size_t len;
+    cp = decodeUtf8(mSource, mPos, len);
+    mPos += len;
+    return true;
+  }
+
+  void parseClass(Fragment &out) {
+    mPos++;
+    Regex::CharClass cls;
+    cls.negate = consume("^");
+
+    while (!done() && peek() != ']') {
+      uint32_t lo;
+      if (!parseClassAtom(cls.ranges, lo)) {
+        continue;
+      }
+
+      uint32_t hi = lo;
+      if (peek() == '-' && peek(1) != ']' && peek(1) != '\0') {
+        mPos++;
+        if (!parseClassAtom(cls.ranges, hi) || hi < lo) {
+          throw RegexUnsupported();
+        }
+      }
+
+      cls.ranges.push_back({lo, hi});
+    }
+
+    if (!consume("]")) {
+      throw RegexUnsupported();
+    }
+
+    out.push_back({Regex::CLASS, false, static_cast<uint32_t>(mRegex.mClasses.size()), 0, 0});
+    mRegex.mClasses.push_back(std::move(cls));
+  }
+
+  bool parseNumber(int &value) {
+    size_t start = mPos;
+    value = 0;
+    while (peek() >= '0' && peek() <= '9') {
+      value = std::min(value * 10 + (peek() - '0'), MAX_REPEAT + 1);
+      mPos++;
+    }
+
+    return mPos > start;
+  }
+
+  // Parses {n}, {n,} or {n,m}. A max of -1 means unbounded.
+  bool parseBraces(int &min, int &max) {
+    size_t start = mPos;
+    mPos++;
+    if (!parseNumber(min)) {
+      mPos = start;
+      return false;
+    }
+
+    max = min;
+    if (consume(",")) {
+      if (!parseNumber(max)) {
+        max = -1;
+      }
+    }
+
+    if (!consume("}")) {
+      mPos = start;
+      return false;
+    }
+
+    return true;
+  }
+
+  void parseQuantifier(Fragment &atom, bool quantifiable) {
+    int min, max;
+    switch (peek()) {
+      case '*': mPos++; min = 0; max = -1; break;
+      case '+': mPos++; min = 1; max = -1; break;
+      case '?': mPos++; min = 0; max = 1; break;
+      case '{':
+        if (parseBraces(min, max)) {
+          break;
+        }
+        return;
+      default:
+        return;
+    }
+
+    if (!quantifiable || min > MAX_REPEAT || max > MAX_REPEAT || (max != -1 && max < min)) {
+      throw RegexUnsupported();
+    }
+
+    bool lazy = consume("?");
+    Fragment result;
+    for (int i = 0; i < min; i++) {
+      append(result, atom);
+    }
+
+    if (max == -1) {
+      // L0: SPLIT L1, L2; L1: atom; JMP L0; L2:
+      int end = static_cast<int>(atom.size()) + 2;
+      Fragment star;
+      star.push_back(split(1, end, lazy));
+      append(star, atom);
+      star.push_back({Regex::JMP, false, 0, 0, 0});
+      append(result, star);
+    } else {
+      // SPLIT L1, L2; L1: atom; L2:
+      int end = static_cast<int>(atom.size()) + 1;
+      Fragment optional;
+      optional.push_back(split(1, end, lazy));
+      append(optional, atom);
+      for (int i = min; i < max; i++) {
+        append(result, optional);
+      }
+    }
+
+    atom = std::move(result);
+  }
+
+  Regex::Inst split(int x, int y, bool lazy) {
+    return lazy ? Regex::Inst {Regex::SPLIT, false, 0, y, x} : Regex::Inst {Regex::SPLIT, false, 0, x, y};
+  }
+};
+
+std::shared_ptr<Regex> Regex::compile(const std::string &source) {
+  std::shared_ptr<Regex> regex = std::make_shared<Regex>();
+  try {
+    RegexCompiler(source, *regex).compile();
+  } catch (RegexUnsupported&) {
+    return nullptr;
+  }
+
+  return regex;
+}
+
+class RegexMatcher {
+public:
+  RegexMatcher(const Regex &regex, const std::string &str)
+    : mProgram(regex.mProgram),
+      mClasses(regex.mClasses),
+      mStr(str),
+      mWidth(str.size() + 1) {
+    // Reuse scratch buffers between matches to avoid allocating for every path.
+    // The visited bits are all zero between matches, and only the words a match
+    // set are cleared after it, so it costs what it visits rather than the size
+    // of the program times the length of the path.
+    static thread_local std::vector<uint64_t> visited;
+    static thread_local std::vector<size_t> dirty;
+    static thread_local std::vector<uint8_t> looks;
+    static thread_local std::vector<std::pair<int, size_t>> stack;
+
+    size_t words = (mProgram.size() * mWidth + 63) / 64;
+    if (visited.size() < words) {
+      visited.resize(words, 0);
+    }
+
+    looks.clear();
+    stack.clear();
+
+    mVisited = &visited;
+    mDirty = &dirty;
+    mLooks = &looks;
+    mStack = &stack;
+  }
+
+  ~RegexMatcher() {
+    std::vector<uint64_t> &visited = *mVisited;
+    for (size_t word : *mDirty) {
+      visited[word] = 0;
+    }
+
+    mDirty->clear();
+  }
+
+  bool run(int startPc, size_t startPos, bool inLook) {
+    size_t base = mStack->size();
+    mStack->emplace_back(startPc, startPos);
+
+    while (mStack->size() > base) {
+      int pc = mStack->back().first;
+      size_t pos = mStack->back().second;
+      mStack->pop_back();
+
+      while (!testAndSet(pc, pos)) {
+        const Regex::Inst &inst = mProgram[pc];
+        size_t len = 0;
+        uint32_t c = pos < mStr.size() ? decodeUtf8(mStr, pos, len) : 0;
+
+        bool ok = true;
+        switch (inst.op) {
+          case Regex::CHAR:
+            ok = len > 0 && c == inst.c;
+            pos += len;
+            pc++;
+            break;
+          case Regex::ANY:
+            ok = len > 0 && !isLineTerminator(c);
+            pos += len;
+            pc++;
+            break;
+          case Regex::CLASS:
+            ok = len > 0 && mClasses[inst.c].contains(c);
+            pos += len;
+            pc++;
+            break;
+          case Regex::SPLIT:
+            mStack->emplace_back(inst.y, pos);
+            pc = inst.x;
+            break;
+          case Regex::JMP:
+            pc = inst.x;
+            break;
+          case Regex::BOL:
+            ok = pos == 0;
+            pc++;
+            break;
+          case Regex::EOL:
+            ok = pos == mStr.size();
+            pc++;
+            break;
+          case Regex::LOOK:
+            ok = look(pc, pos) != inst.negate;
+            pc = inst.x;
+            break;
+          case Regex::MATCH:
+            if (inLook || pos == mStr.size()) {
+              mStack->resize(base);
+              return true;
+            }
+
+            ok = false;
+            break;
+        }
+
+        if (!ok) {
+          break;
+        }
+      }
+    }
+
+    return false;
+  }
+
+private:
+  const std::vector<Regex::Inst> &mProgram;
+  const std::vector<Regex::CharClass> &mClasses;
+  const std::string &mStr;
+  size_t mWidth;
+  std::vector<uint64_t> *mVisited;
+  // Indices of the visited words that were set since they were last zero.
+  std::vector<size_t> *mDirty;
+  std::vector<uint8_t> *mLooks;
+  std::vector<std::pair<int, size_t>> *mStack;
+
+  bool testAndSet(int pc, size_t pos) {
+    size_t bit = pc * mWidth + pos;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    uint64_t &word = (*mVisited)[bit / 64];
+    if (word == 0) {
+      mDirty->push_back(bit / 64);
+    }
+
+    bool isSet = word & mask;
+    word |= mask;
+    return isSet;
+  }
+
+  // Clears the visited bits in [start, end).
+  void clear(size_t start, size_t end) {
+    std::vector<uint64_t> &visited = *mVisited;
+    while (start < end && start % 64 != 0) {
+      visited[start / 64] &= ~((uint64_t)1 << (start % 64));
+      start++;
+    }
+
+    while (start + 64 <= end) {
+      visited[start / 64] = 0;
+      start += 64;
+    }
+
+    while (start < end) {
+      visited[start / 64] &= ~((uint64_t)1 << (start % 64));
+      start++;
+    }
+  }
+
+  // Evaluates the lookahead starting at pc. Results are cached per position, and the
+  // visited states of the sub-program are cleared afterward so that it can run again
+  // from another position.
+  bool look(int pc, size_t pos) {
+    const Regex::Inst &inst = mProgram[pc];
+    size_t index = inst.y * mWidth + pos;
+    if (mLooks->size() <= index) {
+      mLooks->resize((inst.y + 1) * mWidth, 0);
+    }
+
+    uint8_t cached = (*mLooks)[index];
+    if (cached) {
+      return cached == 1;
+    }
+
+    bool result = run(pc + 1, pos, true);
+    clear((pc + 1) * mWidth, inst.x * mWidth);
+
+    (*mLooks)[index] = result ? 1 : 2;
+    return result;
+  }
+};
+
+bool Regex::match(const std::string &str) const {
+  return RegexMatcher(*this, str).run(0, 0, false);
+}
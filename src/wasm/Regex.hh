@@ -0,0 +1,63 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+// A small backtracking regex engine used by the wasm build so that glob
+// matching does not have to cross into JS for every path. It supports the
+// subset of JS regex syntax that picomatch and the RegExp ignore wrapper
+// produce: groups, alternation, character classes, greedy and lazy
+// quantifiers, anchors and lookaheads. Anything else (backreferences,
+// lookbehinds, word boundaries) fails to compile, and the caller is
+// expected to fall back to the JS regex engine.
+//
+// Matching is memoized on (instruction, position), so it runs in time
+// proportional to the program size times the path length.
+class Regex {
+public:
+  static std::shared_ptr<Regex> compile(const std::string &source);
+  bool match(const std::string &str) const;
+
+  enum Op : uint8_t {
+    CHAR,
+    ANY,
+    CLASS,
+    SPLIT,
+    JMP,
+    BOL,
+    EOL,
+    LOOK,
+    MATCH
+  };
+
+  struct Inst {
+    Op op;
+    bool negate;
+    uint32_t c;
+    int x;
+    int y;
+  };
+
+  struct Range {
+    uint32_t lo;
+    uint32_t hi;
+  };
+
+  struct CharClass {
+    std::vector<Range> ranges;
+    bool negate;
+    bool contains(uint32_t c) const;
+  };
+
+private:
+  std::vector<Inst> mProgram;
+  std::vector<CharClass> mClasses;
+
+  friend class RegexCompiler;
+  friend class RegexMatcher;
+};
+
+#endif
@@ -1,31 +1,53 @@
 #include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
 #include "./BSER.hh"
 
-BSERType decodeType(std::istream &iss) {
-  int8_t type;
-  iss.read(reinterpret_cast<char*>(&type), sizeof(type));
-  return (BSERType) type;
+size_t intSize(int64_t value) {
+  if (value >= INT8_MIN && value <= INT8_MAX) {
+    return 1 + sizeof(int8_t);
+  } else if (value >= INT16_MIN && value <= INT16_MAX) {
+    return 1 + sizeof(int16_t);
+  } else if (value >= INT32_MIN && value <= INT32_MAX) {
+    return 1 + sizeof(int32_t);
+  }
+
+  return 1 + sizeof(int64_t);
+}
+
+template<typename T>
+char *encodeRaw(char *out, BSERType type, T value) {
+  *out++ = (char)type;
+  memcpy(out, &value, sizeof(T));
+  return out + sizeof(T);
 }
 
-void expectType(std::istream &iss, BSERType expected) {
-  BSERType got = decodeType(iss);
-  if (got != expected) {
-    throw std::runtime_error("Unexpected BSER type");
+char *encodeInt(char *out, int64_t value) {
+  switch (intSize(value)) {
+    case 1 + sizeof(int8_t): return encodeRaw(out, BSER_INT8, (int8_t)value);
+    case 1 + sizeof(int16_t): return encodeRaw(out, BSER_INT16, (int16_t)value);
+    case 1 + sizeof(int32_t): return encodeRaw(out, BSER_INT32, (int32_t)value);
+    default: return encodeRaw(out, BSER_INT64, value);
   }
 }
 
-void encodeType(std::ostream &oss, BSERType type) {
-  int8_t t = (int8_t)type;
-  oss.write(reinterpret_cast<char*>(&t), sizeof(t));
+size_t stringSize(const std::string &value) {
+  return 1 + intSize(value.size()) + value.size();
+}
+
+char *encodeString(char *out, const std::string &value) {
+  *out++ = (char)BSER_STRING;
+  out = encodeInt(out, value.size());
+  memcpy(out, value.data(), value.size());
+  return out + value.size();
 }
 
 template<typename T>
 class Value : public BSERValue {
 public:
   T value;
-  Value(T val) {
-    value = val;
-  }
+  Value(T val) : value(std::move(val)) {}
 
   Value() {}
 };
@@ -33,149 +55,106 @@ public:
 class BSERInteger : public Value<int64_t> {
 public:
   BSERInteger(int64_t value) : Value(value) {}
-  BSERInteger(std::istream &iss) {
-    int8_t int8;
-    int16_t int16;
-    int32_t int32;
-    int64_t int64;
-
-    BSERType type = decodeType(iss);
-
-    switch (type) {
-      case BSER_INT8:
-        iss.read(reinterpret_cast<char*>(&int8), sizeof(int8));
-        value = int8;
-        break;
-      case BSER_INT16:
-        iss.read(reinterpret_cast<char*>(&int16), sizeof(int16));
-        value = int16;
-        break;
-      case BSER_INT32:
-        iss.read(reinterpret_cast<char*>(&int32), sizeof(int32));
-        value = int32;
-        break;
-      case BSER_INT64:
-        iss.read(reinterpret_cast<char*>(&int64), sizeof(int64));
-        value = int64;
-        break;
-      default:
-        throw std::runtime_error("Invalid BSER int type");
-    }
-  }
 
   int64_t intValue() override {
     return value;
   }
 
-  void encode(std::ostream &oss) override {
-    if (value <= INT8_MAX) {
-      encodeType(oss, BSER_INT8);
-      int8_t v = (int8_t)value;
-      oss.write(reinterpret_cast<char*>(&v), sizeof(v));
-    } else if (value <= INT16_MAX) {
-      encodeType(oss, BSER_INT16);
-      int16_t v = (int16_t)value;
-      oss.write(reinterpret_cast<char*>(&v), sizeof(v));
-    } else if (value <= INT32_MAX) {
-      encodeType(oss, BSER_INT32);
-      int32_t v = (int32_t)value;
-      oss.write(reinterpret_cast<char*>(&v), sizeof(v));
-    } else {
-      encodeType(oss, BSER_INT64);
-      oss.write(reinterpret_cast<char*>(&value), sizeof(value));
-    }
+  size_t encodedSize() override {
+    return intSize(value);
+  }
+
+  char *encode(char *out) override {
+    return encodeInt(out, value);
   }
 };
 
 class BSERArray : public Value<BSER::Array> {
 public:
   BSERArray() : Value() {}
-  BSERArray(BSER::Array value) : Value(value) {}
-  BSERArray(std::istream &iss) {
-    expectType(iss, BSER_ARRAY);
-    int64_t len = BSERInteger(iss).intValue();
-    for (int64_t i = 0; i < len; i++) {
-      value.push_back(BSER(iss));
-    }
-  }
+  BSERArray(BSER::Array value) : Value(std::move(value)) {}
 
   BSER::Array arrayValue() override {
     return value;
   }
 
-  void encode(std::ostream &oss) override {
-    encodeType(oss, BSER_ARRAY);
-    BSERInteger(value.size()).encode(oss);
+  size_t encodedSize() override {
+    size_t size = 1 + intSize(value.size());
+    for (auto it = value.begin(); it != value.end(); it++) {
+      size += it->encodedSize();
+    }
+    return size;
+  }
+
+  char *encode(char *out) override {
+    *out++ = (char)BSER_ARRAY;
+    out = encodeInt(out, value.size());
     for (auto it = value.begin(); it != value.end(); it++) {
-      it->encode(oss);
+      out = it->encode(out);
     }
+    return out;
   }
 };
 
 class BSERString : public Value<std::string> {
 public:
-  BSERString(std::string value) : Value(value) {}
-  BSERString(std::istream &iss) {
-    expectType(iss, BSER_STRING);
-    int64_t len = BSERInteger(iss).intValue();
-    value.resize(len);
-    iss.read(&value[0], len);
-  }
+  BSERString(std::string value) : Value(std::move(value)) {}
 
   std::string stringValue() override {
     return value;
   }
 
-  void encode(std::ostream &oss) override {
-    encodeType(oss, BSER_STRING);
-    BSERInteger(value.size()).encode(oss);
-    oss << value;
+  size_t encodedSize() override {
+    return stringSize(value);
+  }
+
+  char *encode(char *out) override {
+    return encodeString(out, value);
   }
 };
 
 class BSERObject : public Value<BSER::Object> {
 public:
   BSERObject() : Value() {}
-  BSERObject(BSER::Object value) : Value(value) {}
-  BSERObject(std::istream &iss) {
-    expectType(iss, BSER_OBJECT);
-    int64_t len = BSERInteger(iss).intValue();
-    for (int64_t i = 0; i < len; i++) {
-      auto key = BSERString(iss).stringValue();
-      auto val = BSER(iss);
-      value.emplace(key, val);
-    }
-  }
+  BSERObject(BSER::Object value) : Value(std::move(value)) {}
 
   BSER::Object objectValue() override {
     return value;
   }
 
-  void encode(std::ostream &oss) override {
-    encodeType(oss, BSER_OBJECT);
-    BSERInteger(value.size()).encode(oss);
+  size_t encodedSize() override {
+    size_t size = 1 + intSize(value.size());
     for (auto it = value.begin(); it != value.end(); it++) {
-      BSERString(it->first).encode(oss);
-      it->second.encode(oss);
+      size += stringSize(it->first) + it->second.encodedSize();
     }
+    return size;
+  }
+
+  char *encode(char *out) override {
+    *out++ = (char)BSER_OBJECT;
+    out = encodeInt(out, value.size());
+    for (auto it = value.begin(); it != value.end(); it++) {
+      out = encodeString(out, it->first);
+      out = it->second.encode(out);
+    }
+    return out;
   }
 };
 
 class BSERDouble : public Value<double> {
 public:
   BSERDouble(double value) : Value(value) {}
-  BSERDouble(std::istream &iss) {
-    expectType(iss, BSER_REAL);
-    iss.read(reinterpret_cast<char*>(&value), sizeof(value));
-  }
 
   double doubleValue() override {
     return value;
   }
 
-  void encode(std::ostream &oss) override {
-    encodeType(oss, BSER_REAL);
-    oss.write(reinterpret_cast<char*>(&value), sizeof(value));
+  size_t encodedSize() override {
+    return 1 + sizeof(double);
+  }
+
+  char *encode(char *out) override {
+    return encodeRaw(out, BSER_REAL, value);
   }
 };
 
@@ -183,89 +162,26 @@ class BSERBoolean : public Value<bool> {
 public:
   BSERBoolean(bool value) : Value(value) {}
   bool boolValue() override { return value; }
-  void encode(std::ostream &oss) override {
-    int8_t t = value == true ? static_cast<int8_t>(BSER_BOOL_TRUE) : static_cast<int8_t>(BSER_BOOL_FALSE);
-    oss.write(reinterpret_cast<char*>(&t), sizeof(t));
+  char *encode(char *out) override {
+    *out++ = (char)(value ? BSER_BOOL_TRUE : BSER_BOOL_FALSE);
+    return out;
   }
 };
 
 class BSERNull : public Value<bool> {
 public:
   BSERNull() : Value(false) {}
-  void encode(std::ostream &oss) override {
-    encodeType(oss, BSER_NULL);
+  char *encode(char *out) override {
+    *out++ = (char)BSER_NULL;
+    return out;
   }
 };
 
-std::shared_ptr<BSERArray> decodeTemplate(std::istream &iss) {
-  expectType(iss, BSER_TEMPLATE);
-  auto keys = BSERArray(iss).arrayValue();
-  auto len = BSERInteger(iss).intValue();
-  std::shared_ptr<BSERArray> arr = std::make_shared<BSERArray>();
-  for (int64_t i = 0; i < len; i++) {
-    BSER::Object obj;
-    for (auto it = keys.begin(); it != keys.end(); it++) {
-      if (iss.peek() == 0x0c) {
-        iss.ignore(1);
-        continue;
-      }
-
-      auto val = BSER(iss);
-      obj.emplace(it->stringValue(), val);
-    }
-    arr->value.push_back(obj);
-  }
-  return arr;
-}
-
-BSER::BSER(std::istream &iss) {
-  BSERType type = decodeType(iss);
-  iss.unget();
-
-  switch (type) {
-    case BSER_ARRAY:
-      m_ptr = std::make_shared<BSERArray>(iss);
-      break;
-    case BSER_OBJECT:
-      m_ptr = std::make_shared<BSERObject>(iss);
-      break;
-    case BSER_STRING:
-      m_ptr = std::make_shared<BSERString>(iss);
-      break;
-    case BSER_INT8:
-    case BSER_INT16:
-    case BSER_INT32:
-    case BSER_INT64:
-      m_ptr = std::make_shared<BSERInteger>(iss);
-      break;
-    case BSER_REAL:
-      m_ptr = std::make_shared<BSERDouble>(iss);
-      break;
-    case BSER_BOOL_TRUE:
-      iss.ignore(1);
-      m_ptr = std::make_shared<BSERBoolean>(true);
-      break;
-    case BSER_BOOL_FALSE:
-      iss.ignore(1);
-      m_ptr = std::make_shared<BSERBoolean>(false);
-      break;
-    case BSER_NULL:
-      iss.ignore(1);
-      m_ptr = std::make_shared<BSERNull>();
-      break;
-    case BSER_TEMPLATE:
-      m_ptr = decodeTemplate(iss);
-      break;
-    default:
-      throw std::runtime_error("unknown BSER type");
-  }
-}
-
 BSER::BSER() : m_ptr(std::make_shared<BSERNull>()) {}
-BSER::BSER(BSER::Array value) : m_ptr(std::make_shared<BSERArray>(value)) {}
-BSER::BSER(BSER::Object value) : m_ptr(std::make_shared<BSERObject>(value)) {}
+BSER::BSER(BSER::Array value) : m_ptr(std::make_shared<BSERArray>(std::move(value))) {}
+BSER::BSER(BSER::Object value) : m_ptr(std::make_shared<BSERObject>(std::move(value))) {}
 BSER::BSER(const char *value) : m_ptr(std::make_shared<BSERString>(value)) {}
-BSER::BSER(std::string value) : m_ptr(std::make_shared<BSERString>(value)) {}
+BSER::BSER(std::string value) : m_ptr(std::make_shared<BSERString>(std::move(value))) {}
 BSER::BSER(int64_t value) : m_ptr(std::make_shared<BSERInteger>(value)) {}
 BSER::BSER(double value) : m_ptr(std::make_shared<BSERDouble>(value)) {}
 BSER::BSER(bool value) : m_ptr(std::make_shared<BSERBoolean>(value)) {}
@@ -276,27 +192,528 @@ std::string BSER::stringValue() { return m_ptr->stringValue(); }
 int64_t BSER::intValue() { return m_ptr->intValue(); }
 double BSER::doubleValue() { return m_ptr->doubleValue(); }
 bool BSER::boolValue() { return m_ptr->boolValue(); }
-void BSER::encode(std::ostream &oss) {
-  m_ptr->encode(oss);
+size_t BSER::encodedSize() const { return m_ptr->encodedSize(); }
+char *BSER::encode(char *out) const { return m_ptr->encode(out); }
+
+// The size of the body is computed first, so that the header and body can be
+// written straight into `out` after growing it once.
+void BSER::encode(std::string &out) const {
+  size_t size = encodedSize();
+  size_t start = out.size();
+  out.resize(start + 2 + intSize(size) + size);
+
+  char *ptr = &out[start];
+  *ptr++ = 0;
+  *ptr++ = 1;
+  ptr = encodeInt(ptr, size);
+  encode(ptr);
+}
+
+std::string BSER::encode() const {
+  std::string out;
+  encode(out);
+  return out;
 }
 
-int64_t BSER::decodeLength(std::istream &iss) {
-  char pdu[2];
-  if (!iss.read(pdu, 2) || pdu[0] != 0 || pdu[1] != 1) {
+// Thrown when a value continues past the bytes buffered so far, but still
+// fits in the PDU. The reader buffers more and tries again.
+struct BSERIncomplete {};
+
+// Decodes values directly from a PDU body into a node arena. Children are
+// reserved before they are decoded so that they end up next to each other.
+// `end` is how much of the body is buffered and `limit` is where it ends.
+class BSERDecoder {
+public:
+  BSERDecoder(const char *data, size_t end, size_t limit, std::vector<BSERNode> &nodes)
+    : mStart(data), mPos(data), mEnd(data + end), mLimit(data + limit), mNodes(nodes) {}
+
+  size_t offset() {
+    return mPos - mStart;
+  }
+
+  void decode(size_t index) {
+    BSERType type = peekType();
+    BSERNode &node = mNodes[index];
+    node.type = type;
+    node.size = 0;
+    node.intValue = 0;
+
+    switch (type) {
+      case BSER_ARRAY: {
+        mPos++;
+        size_t len = decodeLength(1);
+        size_t children = reserve(index, len, len);
+        for (size_t i = 0; i < len; i++) {
+          decode(children + i);
+        }
+        break;
+      }
+      case BSER_OBJECT: {
+        mPos++;
+        // Each entry is at least a one byte key and a value.
+        size_t len = decodeLength(4);
+        size_t children = reserve(index, len, len * 2);
+        for (size_t i = 0; i < len; i++) {
+          decodeString(children + i * 2);
+          decode(children + i * 2 + 1);
+        }
+        break;
+      }
+      case BSER_STRING:
+        decodeString(index);
+        break;
+      case BSER_INT8:
+      case BSER_INT16:
+      case BSER_INT32:
+      case BSER_INT64:
+        node.type = BSER_INT64;
+        node.intValue = decodeInt();
+        break;
+      case BSER_REAL:
+        mPos++;
+        read(&node.doubleValue, sizeof(double));
+        break;
+      case BSER_BOOL_TRUE:
+      case BSER_BOOL_FALSE:
+      case BSER_NULL:
+        mPos++;
+        break;
+      case BSER_TEMPLATE:
+        decodeTemplate(index);
+        break;
+      default:
+        throw std::runtime_error("unknown BSER type");
+    }
+  }
+
+  BSERType peekType() {
+    need(1);
+    return (BSERType) *mPos;
+  }
+
+  void expectType(BSERType expected) {
+    if (peekType() != expected) {
+      throw std::runtime_error("Unexpected BSER type");
+    }
+
+    mPos++;
+  }
+
+  int64_t decodeInt() {
+    int8_t int8;
+    int16_t int16;
+    int32_t int32;
+    int64_t int64;
+
+    BSERType type = peekType();
+    mPos++;
+    switch (type) {
+      case BSER_INT8:
+        read(&int8, sizeof(int8));
+        return int8;
+      case BSER_INT16:
+        read(&int16, sizeof(int16));
+        return int16;
+      case BSER_INT32:
+        read(&int32, sizeof(int32));
+        return int32;
+      case BSER_INT64:
+        read(&int64, sizeof(int64));
+        return int64;
+      default:
+        throw std::runtime_error("Invalid BSER int type");
+    }
+  }
+
+  // Reads a count of items that take at least `itemSize` bytes each, so that a
+  // corrupt length can't make us reserve more nodes than the input could hold.
+  size_t decodeLength(size_t itemSize) {
+    int64_t len = decodeInt();
+    if (len < 0 || (uint64_t)len > (size_t)(mLimit - mPos) / itemSize || len > UINT32_MAX) {
+      throw std::runtime_error("Invalid BSER length");
+    }
+
+    return (size_t)len;
+  }
+
+  void decodeString(size_t index) {
+    expectType(BSER_STRING);
+    size_t len = decodeLength(1);
+    need(len);
+    BSERNode &node = mNodes[index];
+    node.type = BSER_STRING;
+    node.size = static_cast<uint32_t>(len);
+    node.data = mPos;
+    mPos += len;
+  }
+
+  // Reads the keys of a template, up to its row count.
+  void decodeTemplateKeys(std::vector<BSERNode> &keys) {
+    expectType(BSER_TEMPLATE);
+    expectType(BSER_ARRAY);
+    size_t keyCount = decodeLength(1);
+    size_t first = mNodes.size();
+    mNodes.resize(first + keyCount);
+    for (size_t i = 0; i < keyCount; i++) {
+      decodeString(first + i);
+    }
+
+    keys.assign(mNodes.begin() + first, mNodes.end());
+    mNodes.resize(first);
+  }
+
+  size_t decodeTemplateRows(size_t keyCount) {
+    int64_t rows = decodeInt();
+    size_t remaining = mLimit - mPos;
+    if (rows < 0 || (uint64_t)rows > remaining || rows > UINT32_MAX || (keyCount > 0 && (uint64_t)rows > remaining / keyCount)) {
+      throw std::runtime_error("Invalid BSER length");
+    }
+
+    return (size_t)rows;
+  }
+
+  // Template rows are decoded as objects. The key nodes are copied into each
+  // row, and skipped values are kept as BSER_SKIP nodes.
+  void decodeTemplateRow(size_t index, const std::vector<BSERNode> &keys) {
+    mNodes[index].type = BSER_OBJECT;
+    size_t values = reserve(index, keys.size(), keys.size() * 2);
+    for (size_t i = 0; i < keys.size(); i++) {
+      mNodes[values + i * 2] = keys[i];
+      if (peekType() == BSER_SKIP) {
+        mPos++;
+        mNodes[values + i * 2 + 1].type = BSER_SKIP;
+        continue;
+      }
+
+      decode(values + i * 2 + 1);
+    }
+  }
+
+private:
+  const char *mStart;
+  const char *mPos;
+  const char *mEnd;
+  const char *mLimit;
+  std::vector<BSERNode> &mNodes;
+
+  void need(size_t len) {
+    if ((size_t)(mEnd - mPos) >= len) {
+      return;
+    }
+
+    if ((size_t)(mLimit - mPos) >= len) {
+      throw BSERIncomplete();
+    }
+
+    throw std::runtime_error("Invalid BSER");
+  }
+
+  void read(void *dest, size_t len) {
+    need(len);
+    memcpy(dest, mPos, len);
+    mPos += len;
+  }
+
+  size_t reserve(size_t index, size_t size, size_t count) {
+    size_t children = mNodes.size();
+    mNodes[index].size = static_cast<uint32_t>(size);
+    mNodes[index].children = children;
+    mNodes.resize(children + count);
+    return children;
+  }
+
+  // Templates are expanded into an array of objects.
+  void decodeTemplate(size_t index) {
+    std::vector<BSERNode> keys;
+    decodeTemplateKeys(keys);
+    size_t rows = decodeTemplateRows(keys.size());
+    mNodes[index].type = BSER_ARRAY;
+    size_t children = reserve(index, rows, rows);
+    for (size_t row = 0; row < rows; row++) {
+      decodeTemplateRow(children + row, keys);
+    }
+  }
+};
+
+int64_t BSERDocument::decodeHeader(const char *data, size_t len, size_t *headerSize) {
+  *headerSize = 3;
+  if (len < 2) {
+    return -1;
+  }
+
+  if (data[0] != 0 || data[1] != 1) {
+    throw std::runtime_error("Invalid BSER");
+  }
+
+  if (len < 3) {
+    return -1;
+  }
+
+  switch ((BSERType) data[2]) {
+    case BSER_INT8: *headerSize += sizeof(int8_t); break;
+    case BSER_INT16: *headerSize += sizeof(int16_t); break;
+    case BSER_INT32: *headerSize += sizeof(int32_t); break;
+    case BSER_INT64: *headerSize += sizeof(int64_t); break;
+    default:
+      throw std::runtime_error("Invalid BSER int type");
+  }
+
+  if (len < *headerSize) {
+    return -1;
+  }
+
+  size_t size = *headerSize - 2;
+  std::vector<BSERNode> nodes;
+  int64_t length = BSERDecoder(data + 2, size, size, nodes).decodeInt();
+  if (length < 0) {
+    throw std::runtime_error("Invalid BSER length");
+  }
+
+  return length;
+}
+
+void BSERDocument::decodeBody(size_t offset) {
+  size_t len = mBuffer.size() - offset;
+  mNodes.clear();
+  mNodes.resize(1);
+  BSERDecoder decoder(mBuffer.data() + offset, len, len, mNodes);
+  decoder.decode(0);
+  if (decoder.offset() != len) {
+    throw std::runtime_error("Invalid BSER");
+  }
+}
+
+BSERView BSERDocument::root() const {
+  if (mNodes.empty()) {
+    return BSERView();
+  }
+
+  return BSERView(mNodes.data(), 0);
+}
+
+BSERType BSERView::type() const {
+  return mNodes ? mNodes[mIndex].type : BSER_NULL;
+}
+
+size_t BSERView::size() const {
+  if (!mNodes || (type() != BSER_ARRAY && type() != BSER_OBJECT)) {
+    return 0;
+  }
+
+  return mNodes[mIndex].size;
+}
+
+BSERView BSERView::operator[](size_t index) const {
+  if (type() != BSER_ARRAY || index >= size()) {
+    return BSERView();
+  }
+
+  return BSERView(mNodes, mNodes[mIndex].children + index);
+}
+
+BSERView BSERView::find(std::string_view key) const {
+  if (type() != BSER_OBJECT) {
+    return BSERView();
+  }
+
+  const BSERNode &node = mNodes[mIndex];
+  for (size_t i = 0; i < node.size; i++) {
+    size_t keyIndex = node.children + i * 2;
+    const BSERNode &k = mNodes[keyIndex];
+    if (k.size == key.size() && memcmp(k.data, key.data(), k.size) == 0) {
+      if (mNodes[keyIndex + 1].type == BSER_SKIP) {
+        return BSERView();
+      }
+
+      return BSERView(mNodes, keyIndex + 1);
+    }
+  }
+
+  return BSERView();
+}
+
+std::string_view BSERView::stringValue() const {
+  if (type() != BSER_STRING) {
+    return std::string_view();
+  }
+
+  return std::string_view(mNodes[mIndex].data, mNodes[mIndex].size);
+}
+
+int64_t BSERView::intValue() const {
+  return type() == BSER_INT64 ? mNodes[mIndex].intValue : 0;
+}
+
+double BSERView::doubleValue() const {
+  return type() == BSER_REAL ? mNodes[mIndex].doubleValue : 0;
+}
+
+bool BSERView::boolValue() const {
+  return type() == BSER_BOOL_TRUE;
+}
+
+// Reads at least `len` bytes of the stream into the buffer, moving what is
+// left of the previous read to the front first.
+void BSERReader::fill(size_t len) {
+  if (mStart > 0) {
+    memmove(mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart);
+    mEnd -= mStart;
+    mStart = 0;
+  }
+
+  if (mBuffer.size() < std::max(len, BSER_READ_SIZE)) {
+    mBuffer.resize(std::max(len, BSER_READ_SIZE));
+  }
+
+  while (mEnd < len) {
+    size_t r = mRead(mBuffer.data() + mEnd, mBuffer.size() - mEnd);
+    if (r == 0) {
+      throw std::runtime_error("Unexpected end of BSER");
+    }
+
+    mEnd += r;
+  }
+}
+
+// Runs fn with a decoder over the buffered part of the PDU, reading more until
+// it completes. The buffer grows geometrically, so that a value larger than a
+// single read is only decoded a few times. Returns the number of bytes consumed.
+template<typename Fn>
+size_t BSERReader::decode(Fn fn) {
+  while (true) {
+    size_t available = mEnd - mStart;
+    mNodes.clear();
+    mNodes.resize(1);
+    BSERDecoder decoder(mBuffer.data() + mStart, (size_t)std::min<uint64_t>(available, mRemaining), (size_t)mRemaining, mNodes);
+    try {
+      fn(decoder);
+    } catch (BSERIncomplete &) {
+      fill((size_t)std::min<uint64_t>(mRemaining, std::max(available * 2, BSER_READ_SIZE)));
+      continue;
+    }
+
+    size_t consumed = decoder.offset();
+    mStart += consumed;
+    mRemaining -= consumed;
+    return consumed;
+  }
+}
+
+void BSERReader::read(BSERDocument &doc, std::string_view key, EntryFn onEntry, ElementFn onElement) {
+  size_t headerSize = 2;
+  int64_t len;
+  while ((len = BSERDocument::decodeHeader(mBuffer.data() + mStart, mEnd - mStart, &headerSize)) == -1) {
+    fill(headerSize);
+  }
+
+  mStart += headerSize;
+  mRemaining = len;
+
+  size_t count = 0;
+  decode([&count] (BSERDecoder &decoder) {
+    decoder.expectType(BSER_OBJECT);
+    count = decoder.decodeLength(4);
+  });
+
+  // The entries we keep are copied into the document's buffer as an object,
+  // which is decoded once the whole PDU has been read.
+  std::vector<char> &out = doc.mBuffer;
+  out.clear();
+  out.push_back(BSER_OBJECT);
+  out.push_back(BSER_INT32);
+  out.resize(out.size() + sizeof(int32_t));
+
+  std::string name;
+  for (size_t i = 0; i < count; i++) {
+    size_t consumed = decode([] (BSERDecoder &decoder) {
+      decoder.decodeString(0);
+    });
+
+    name.assign(mNodes[0].data, mNodes[0].size);
+    out.insert(out.end(), mBuffer.data() + mStart - consumed, mBuffer.data() + mStart);
+
+    BSERType type;
+    decode([&type] (BSERDecoder &decoder) {
+      type = decoder.peekType();
+    });
+
+    if (onElement && name == key && (type == BSER_ARRAY || type == BSER_TEMPLATE)) {
+      streamArray(type, onElement);
+      out.push_back(BSER_ARRAY);
+      out.push_back(BSER_INT8);
+      out.push_back(0);
+      continue;
+    }
+
+    consumed = decode([] (BSERDecoder &decoder) {
+      decoder.decode(0);
+    });
+
+    if (onEntry) {
+      onEntry(name, BSERView(mNodes.data(), 0));
+    }
+
+    out.insert(out.end(), mBuffer.data() + mStart - consumed, mBuffer.data() + mStart);
+  }
+
+  if (mRemaining != 0) {
     throw std::runtime_error("Invalid BSER");
   }
 
-  return BSERInteger(iss).intValue();
+  int32_t count32 = static_cast<int32_t>(count);
+  memcpy(out.data() + 2, &count32, sizeof(count32));
+  doc.decodeBody(0);
+
+  // Don't hold on to the memory needed for an unusually large value.
+  if (mBuffer.size() > BSER_READ_SIZE && mEnd - mStart <= BSER_READ_SIZE) {
+    fill(0);
+    mBuffer.resize(BSER_READ_SIZE);
+    mBuffer.shrink_to_fit();
+  }
 }
 
-std::string BSER::encode() {
-  std::ostringstream oss(std::ios_base::binary);
-  encode(oss);
+void BSERReader::streamArray(BSERType type, ElementFn &onElement) {
+  if (type == BSER_ARRAY) {
+    size_t len = 0;
+    decode([&len] (BSERDecoder &decoder) {
+      decoder.expectType(BSER_ARRAY);
+      len = decoder.decodeLength(1);
+    });
+
+    for (size_t i = 0; i < len; i++) {
+      decode([] (BSERDecoder &decoder) {
+        decoder.decode(0);
+      });
+
+      onElement(BSERView(mNodes.data(), 0));
+    }
+
+    return;
+  }
 
-  std::ostringstream res(std::ios_base::binary);
-  res.write("\x00\x01", 2);
+  // Template keys point into the read buffer, so keep copies of them for the rows.
+  std::vector<BSERNode> keys;
+  decode([&keys] (BSERDecoder &decoder) {
+    decoder.decodeTemplateKeys(keys);
+  });
+
+  std::vector<std::string> names;
+  names.reserve(keys.size());
+  for (auto &k : keys) {
+    names.emplace_back(k.data, k.size);
+    k.data = names.back().data();
+  }
 
-  BSERInteger(oss.str().size()).encode(res);
-  res << oss.str();
-  return res.str();
+  size_t rows = 0;
+  decode([&rows, &keys] (BSERDecoder &decoder) {
+    rows = decoder.decodeTemplateRows(keys.size());
+  });
+
+  for (size_t i = 0; i < rows; i++) {
+    decode([&keys] (BSERDecoder &decoder) {
+      decoder.decodeTemplateRow(0, keys);
+    });
+
+    onElement(BSERView(mNodes.data(), 0));
+  }
 }
@@ -2,10 +2,12 @@
 #define BSER_H
 
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <functional>
 
 enum BSERType {
   BSER_ARRAY = 0x00,
@@ -19,7 +21,8 @@ enum BSERType {
   BSER_BOOL_TRUE = 0x08,
   BSER_BOOL_FALSE = 0x09,
   BSER_NULL = 0x0a,
-  BSER_TEMPLATE = 0x0b
+  BSER_TEMPLATE = 0x0b,
+  BSER_SKIP = 0x0c
 };
 
 class BSERValue;
@@ -37,7 +40,6 @@ public:
   BSER(int64_t value);
   BSER(double value);
   BSER(bool value);
-  BSER(std::istream &iss);
 
   BSER::Array arrayValue();
   BSER::Object objectValue();
@@ -45,10 +47,13 @@ public:
   int64_t intValue();
   double doubleValue();
   bool boolValue();
-  void encode(std::ostream &oss);
+  size_t encodedSize() const;
+  // Writes the value to out, which must have room for encodedSize() bytes.
+  char *encode(char *out) const;
 
-  static int64_t decodeLength(std::istream &iss);
-  std::string encode();
+  // Appends the value to out as a PDU.
+  void encode(std::string &out) const;
+  std::string encode() const;
 private:
   std::shared_ptr<BSERValue> m_ptr;
 };
@@ -62,8 +67,106 @@ protected:
   virtual int64_t intValue() { return 0; }
   virtual double doubleValue() { return 0; }
   virtual bool boolValue() { return false; }
-  virtual void encode(std::ostream &oss) {}
+  virtual size_t encodedSize() { return 1; }
+  virtual char *encode(char *out) { return out; }
   virtual ~BSERValue() {}
 };
 
+// A decoded value in a BSERDocument's arena. Strings point into the document's
+// buffer, and the children of arrays and objects are stored contiguously from
+// index `children`. Objects store their keys and values interleaved.
+struct BSERNode {
+  BSERType type;
+  uint32_t size;
+  union {
+    int64_t intValue;
+    double doubleValue;
+    const char *data;
+    size_t children;
+  };
+};
+
+// A read-only reference to a node in a BSERDocument. It is only valid while the
+// document is alive. Accessors return defaults for missing or mismatched values.
+class BSERView {
+public:
+  BSERView() : mNodes(nullptr), mIndex(0) {}
+  BSERView(const BSERNode *nodes, size_t index) : mNodes(nodes), mIndex(index) {}
+  explicit operator bool() const { return mNodes != nullptr; }
+
+  BSERType type() const;
+  size_t size() const;
+  BSERView operator[](size_t index) const;
+  BSERView find(std::string_view key) const;
+  std::string_view stringValue() const;
+  int64_t intValue() const;
+  double doubleValue() const;
+  bool boolValue() const;
+private:
+  const BSERNode *mNodes;
+  size_t mIndex;
+};
+
+// A PDU decoded in place from a contiguous buffer, filled by BSERReader. The
+// buffer and node arena are kept when reading again, so a document can be
+// reused for many PDUs.
+class BSERDocument {
+  friend class BSERReader;
+public:
+  BSERDocument() {}
+  BSERDocument(const BSERDocument &) = delete;
+  BSERDocument &operator=(const BSERDocument &) = delete;
+  BSERDocument(BSERDocument &&) = default;
+  BSERDocument &operator=(BSERDocument &&) = default;
+
+  BSERView root() const;
+
+  // Returns the length of the PDU body, or -1 if more than `len` bytes are needed
+  // to know it. `headerSize` is set to the size of the header once known.
+  static int64_t decodeHeader(const char *data, size_t len, size_t *headerSize);
+private:
+  std::vector<char> mBuffer;
+  std::vector<BSERNode> mNodes;
+
+  void decodeBody(size_t offset);
+};
+
+class BSERDecoder;
+
+// How much the reader asks for at once. Its buffer only grows past this for
+// single values that are larger.
+const size_t BSER_READ_SIZE = 64 * 1024;
+
+// Reads PDUs from a stream through a reusable buffer, keeping any bytes of the
+// next PDU for the following read. Root entries are decoded one at a time, and
+// the elements of one array can be streamed to a callback as they arrive
+// instead of being stored, so it never needs to be buffered whole.
+class BSERReader {
+public:
+  typedef std::function<size_t(char *, size_t)> ReadFn;
+  typedef std::function<void(std::string_view, BSERView)> EntryFn;
+  typedef std::function<void(BSERView)> ElementFn;
+
+  BSERReader(ReadFn read) : mRead(read), mStart(0), mEnd(0), mRemaining(0) {}
+
+  // Reads the next PDU, which must be an object, into doc. onEntry is called with
+  // each root entry once it has been read. If onElement is given, the elements
+  // of the array under `key` are passed to it as they are decoded, and doc gets
+  // an empty array for that key. Views passed to callbacks are only valid
+  // during the call.
+  void read(BSERDocument &doc, std::string_view key = std::string_view(), EntryFn onEntry = nullptr, ElementFn onElement = nullptr);
+private:
+  ReadFn mRead;
+  std::vector<char> mBuffer;
+  size_t mStart;
+  size_t mEnd;
+  uint64_t mRemaining;
+  std::vector<BSERNode> mNodes;
+
+  void fill(size_t len);
+  template<typename Fn>
+  size_t decode(Fn fn);
+  void streamArray(BSERType type, ElementFn &onElement);
+};
+
 #endif
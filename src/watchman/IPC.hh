@@ -53,24 +53,35 @@ public:
 
       mSock = socket(AF_UNIX, SOCK_STREAM, 0);
       if (connect(mSock, (struct sockaddr *) &addr, sizeof(struct sockaddr_un))) {
+        close(mSock);
         throw std::runtime_error("Error connecting to socket");
       }
     #endif
   }
 
   ~IPC() {
-    mStopped = true;
+    stop();
     #ifdef _WIN32
-      CancelIo(mPipe);
       CloseHandle(mPipe);
       CloseHandle(mReader);
       CloseHandle(mWriter);
+    #else
+      close(mSock);
+    #endif
+  }
+
+  // Wakes up reads and writes blocked on other threads, which then return
+  // without an error. The connection can't be used afterwards.
+  void stop() {
+    mStopped = true;
+    #ifdef _WIN32
+      CancelIoEx(mPipe, NULL);
     #else
       shutdown(mSock, SHUT_RDWR);
     #endif
   }
 
-  void write(std::string buf) {
+  void write(const std::string &buf) {
     #ifdef _WIN32
       OVERLAPPED overlapped;
       overlapped.hEvent = mWriter;
@@ -103,7 +114,7 @@ public:
       }
     #else
       int r = 0;
-      for (unsigned int i = 0; i != buf.size(); i += r) {
+      for (size_t i = 0; i != buf.size(); i += r) {
         r = ::write(mSock, &buf[i], buf.size() - i);
         if (r == -1) {
           if (errno == EAGAIN) {
@@ -14,38 +14,31 @@
 #define pclose _pclose
 #else
 #include <sys/stat.h>
+#include <unistd.h>
 #define normalizePath(dir) dir
 #endif
 
-template<typename T>
-BSER readBSER(T &&do_read) {
-  std::stringstream oss;
-  char buffer[256];
-  size_t r;
-  int64_t len = -1;
-  do {
-    // Start by reading a minimal amount of data in order to decode the length.
-    // After that, attempt to read the remaining length, up to the buffer size.
-    r = do_read(buffer, len == -1 ? 20 : (len < 256 ? len : 256));
-    oss << std::string(buffer, r);
-
-    if (len == -1) {
-      uint64_t l = BSER::decodeLength(oss);
-      len = l + oss.tellg();
-    }
-
-    len -= r;
-  } while (len > 0);
-
-  return BSER(oss);
-}
+// Finding the socket means running the watchman CLI, so the result is kept for
+// the life of the process. It is dropped when connecting to it fails, in case
+// watchman has been restarted somewhere else.
+static std::mutex sockPathMutex;
+static std::string sockPath;
 
-std::string getSockPath() {
+std::string getSockPath(bool *cached = nullptr) {
   auto var = getenv("WATCHMAN_SOCK");
   if (var && *var) {
     return std::string(var);
   }
 
+  std::unique_lock<std::mutex> lock(sockPathMutex);
+  if (cached) {
+    *cached = !sockPath.empty();
+  }
+
+  if (!sockPath.empty()) {
+    return sockPath;
+  }
+
 #ifdef _WIN32
   FILE *fp = popen("watchman --output-encoding=bser get-sockname", "r");
 #else
@@ -55,32 +48,103 @@ std::string getSockPath() {
     throw std::runtime_error("Failed to execute watchman");
   }
 
-  BSER b = readBSER([fp] (char *buf, size_t len) {
-    return fread(buf, sizeof(char), len, fp);
-  });
+  BSERDocument doc;
+  try {
+    BSERReader reader([fp] (char *buf, size_t len) {
+      return fread(buf, sizeof(char), len, fp);
+    });
+    reader.read(doc);
+  } catch (std::exception &) {
+    pclose(fp);
+    throw;
+  }
 
   pclose(fp);
 
-  auto objValue = b.objectValue();
-  auto foundSockname = objValue.find("sockname");
-  if (foundSockname == objValue.end()) {
+  auto sockname = doc.root().find("sockname");
+  if (!sockname) {
     throw std::runtime_error("sockname not found");
   }
-  return foundSockname->second.stringValue();
+
+  sockPath = std::string(sockname.stringValue());
+  return sockPath;
+}
+
+bool hasSockPath() {
+  auto var = getenv("WATCHMAN_SOCK");
+  std::unique_lock<std::mutex> lock(sockPathMutex);
+  return (var && *var) || !sockPath.empty();
 }
 
 std::unique_ptr<IPC> watchmanConnect() {
-  std::string path = getSockPath();
-  return std::unique_ptr<IPC>(new IPC(path));
+  bool cached = false;
+  std::string path = getSockPath(&cached);
+  try {
+    return std::unique_ptr<IPC>(new IPC(path));
+  } catch (std::exception &) {
+    if (!cached) {
+      throw;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(sockPathMutex);
+      if (sockPath == path) {
+        sockPath.clear();
+      }
+    }
+
+    return std::unique_ptr<IPC>(new IPC(getSockPath()));
+  }
 }
 
-BSER watchmanRead(IPC *ipc) {
-  return readBSER([ipc] (char *buf, size_t len) {
-    return ipc->read(buf, len);
-  });
+// Looks for an executable on the PATH without running anything.
+bool isOnPath(std::string name) {
+  auto var = getenv("PATH");
+  if (!var) {
+    return false;
+  }
+
+#ifdef _WIN32
+  const char sep = ';';
+  name += ".exe";
+#else
+  const char sep = ':';
+#endif
+
+  std::string path(var);
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find(sep, start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+
+    if (end > start) {
+      std::string file = path.substr(start, end - start) + DIR_SEP + name;
+#ifdef _WIN32
+      DWORD attrs = GetFileAttributesA(file.c_str());
+      if (attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+        return true;
+      }
+#else
+      struct stat st;
+      if (access(file.c_str(), X_OK) == 0 && stat(file.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+        return true;
+      }
+#endif
+    }
+
+    start = end + 1;
+  }
+
+  return false;
 }
 
-BSER::Object WatchmanBackend::watchmanRequest(BSER b) {
+#define MAX_IDLE_CONNECTIONS 4
+
+// Sends a command on the subscription connection and waits for the backend
+// thread to read its response.
+BSERDocument WatchmanBackend::subscriptionRequest(BSER b) {
   std::string cmd = b.encode();
   mIPC->write(cmd);
   mRequestSignal.notify();
@@ -94,17 +158,40 @@ BSER::Object WatchmanBackend::watchmanRequest(BSER b) {
     throw err;
   }
 
-  return mResponse;
+  return std::move(mResponse);
 }
 
-void WatchmanBackend::watchmanWatch(std::string dir) {
-  std::vector<BSER> cmd;
+BSER::Array watchCommand(WatcherRef watcher) {
+  BSER::Array cmd;
   cmd.push_back("watch");
-  cmd.push_back(normalizePath(dir));
-  watchmanRequest(cmd);
+  cmd.push_back(normalizePath(watcher->mDir));
+  return cmd;
 }
 
+BSER::Array clockCommand(WatcherRef watcher) {
+  BSER::Array cmd;
+  cmd.push_back("clock");
+  cmd.push_back(normalizePath(watcher->mDir));
+  return cmd;
+}
+
+std::string readClock(WatcherRef watcher, BSERDocument &res) {
+  auto found = res.root().find("clock");
+  if (!found) {
+    throw WatcherError("Error reading clock from watchman", watcher);
+  }
+
+  return std::string(found.stringValue());
+}
+
+// This runs whenever a default backend is created, so it only connects to the
+// socket. The CLI is only run to find it if watchman is installed and the
+// socket isn't known yet.
 bool WatchmanBackend::checkAvailable() {
+  if (!hasSockPath() && !isOnPath("watchman")) {
+    return false;
+  }
+
   try {
     watchmanConnect();
     return true;
@@ -113,61 +200,164 @@ bool WatchmanBackend::checkAvailable() {
   }
 }
 
-void handleFiles(WatcherRef watcher, BSER::Object obj) {
-  auto found = obj.find("files");
-  if (found == obj.end()) {
-    throw WatcherError("Error reading changes from watchman", watcher);
+void handleFile(WatcherRef watcher, std::string_view name, int64_t mode, bool isNew, bool exists,
+                std::optional<EventMetadata> metadata) {
+  auto path = watcher->mDir + DIR_SEP;
+  #ifdef _WIN32
+    size_t dirLength = path.size();
+    path += name;
+    std::replace(path.begin() + dirLength, path.end(), '/', '\\');
+  #else
+    path += name;
+  #endif
+  if (watcher->isIgnored(path)) {
+    return;
   }
 
-  auto files = found->second.arrayValue();
-  for (auto it = files.begin(); it != files.end(); it++) {
-    auto file = it->objectValue();
-    auto name = file.find("name")->second.stringValue();
-    #ifdef _WIN32
-      std::replace(name.begin(), name.end(), '/', '\\');
-    #endif
-    auto mode = file.find("mode")->second.intValue();
-    auto isNew = file.find("new")->second.boolValue();
-    auto exists = file.find("exists")->second.boolValue();
-    auto path = watcher->mDir + DIR_SEP + name;
-    if (watcher->isIgnored(path)) {
-      continue;
+  if (isNew && exists) {
+    watcher->mEvents.create(path, metadata);
+  } else if (exists && !S_ISDIR(mode)) {
+    watcher->mEvents.update(path, metadata);
+  } else if (!isNew && !exists) {
+    watcher->mEvents.remove(path);
+  }
+}
+
+// Metadata is only requested for watchers with the metadata option.
+std::optional<EventMetadata> readMetadata(BSERView file) {
+  if (!file.find("mtime_ms")) {
+    return std::nullopt;
+  }
+
+  return EventMetadata {
+    file.find("mtime_ms").intValue(),
+    file.find("size").intValue(),
+    static_cast<uint64_t>(file.find("ino").intValue())
+  };
+}
+
+void handleFile(WatcherRef watcher, BSERView file) {
+  handleFile(
+    watcher,
+    file.find("name").stringValue(),
+    file.find("mode").intValue(),
+    file.find("new").boolValue(),
+    file.find("exists").boolValue(),
+    readMetadata(file)
+  );
+}
+
+void handleFile(WatcherRef watcher, WatchmanFile &file) {
+  handleFile(watcher, file.name, file.mode, file.isNew, file.exists, file.metadata);
+}
+
+// Writes the commands together on an idle connection, or a new one, and reads
+// their responses in order, so a sequence of commands costs one round trip and
+// commands from different threads don't wait for each other. Files in the
+// responses are turned into events for the watcher as they are read.
+std::vector<BSERDocument> WatchmanBackend::watchmanCommands(std::vector<BSER> cmds, WatcherRef watcher) {
+  std::unique_ptr<WatchmanConnection> conn;
+  {
+    std::unique_lock<std::mutex> lock(mConnectionsMutex);
+    if (!mConnections.empty()) {
+      conn = std::move(mConnections.back());
+      mConnections.pop_back();
     }
+  }
+
+  bool pooled = conn != nullptr;
+  if (!conn) {
+    conn = std::make_unique<WatchmanConnection>(watchmanConnect());
+  }
+
+  conn->commands.clear();
+  for (auto &cmd : cmds) {
+    cmd.encode(conn->commands);
+  }
+
+  std::vector<BSERDocument> responses(cmds.size());
+  while (true) {
+    conn->received = false;
+    try {
+      conn->ipc->write(conn->commands);
+      for (auto &res : responses) {
+        do {
+          if (watcher) {
+            conn->reader.read(res, "files", nullptr, [&watcher] (BSERView file) {
+              handleFile(watcher, file);
+            });
+          } else {
+            conn->reader.read(res);
+          }
+        } while (res.root().find("unilateral"));
+      }
+      break;
+    } catch (std::exception &) {
+      // An idle connection may have been closed by watchman, e.g. when it
+      // restarted. If nothing came back, the other idle connections are likely
+      // closed too, so drop them and retry once on a new connection.
+      if (!pooled || conn->received) {
+        throw;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mConnectionsMutex);
+        mConnections.clear();
+      }
 
-    if (isNew && exists) {
-      watcher->mEvents.create(path);
-    } else if (exists && !S_ISDIR(mode)) {
-      watcher->mEvents.update(path);
-    } else if (!isNew && !exists) {
-      watcher->mEvents.remove(path);
+      auto fresh = std::make_unique<WatchmanConnection>(watchmanConnect());
+      fresh->commands = std::move(conn->commands);
+      conn = std::move(fresh);
+      pooled = false;
     }
   }
+
+  // Only return the connection once all of its responses have been read.
+  {
+    std::unique_lock<std::mutex> lock(mConnectionsMutex);
+    if (mConnections.size() < MAX_IDLE_CONNECTIONS) {
+      mConnections.push_back(std::move(conn));
+    }
+  }
+
+  for (auto &res : responses) {
+    auto error = res.root().find("error");
+    if (error) {
+      throw std::runtime_error(std::string(error.stringValue()));
+    }
+  }
+
+  return responses;
 }
 
-void WatchmanBackend::handleSubscription(BSER::Object obj) {
-  std::unique_lock<std::mutex> lock(mMutex);
-  auto subscription = obj.find("subscription")->second.stringValue();
-  auto it = mSubscriptions.find(subscription);
+WatcherRef WatchmanBackend::findSubscription(std::string_view id) {
+  std::unique_lock<std::mutex> lock(mSubscriptionsMutex);
+  auto it = mSubscriptions.find(std::string(id));
   if (it == mSubscriptions.end()) {
-    return;
+    return nullptr;
   }
 
-  auto watcher = it->second;
-  try {
-    handleFiles(watcher, obj);
-    watcher->notify();
-  } catch (WatcherError &err) {
-    handleWatcherError(err);
-  }
+  return it->second;
 }
 
 void WatchmanBackend::start() {
   mIPC = watchmanConnect();
   notifyStarted();
 
+  // Subscription PDUs are decoded into the same document to reuse its buffers.
+  // Responses are moved out to the requesting thread.
+  BSERDocument doc;
+  std::vector<WatchmanFile> files;
+
   while (true) {
     // If there are no subscriptions we are reading, wait for a request.
-    if (mSubscriptions.size() == 0) {
+    bool hasSubscriptions;
+    {
+      std::unique_lock<std::mutex> lock(mSubscriptionsMutex);
+      hasSubscriptions = mSubscriptions.size() > 0;
+    }
+
+    if (!hasSubscriptions) {
       mRequestSignal.wait();
       mRequestSignal.reset();
     }
@@ -179,15 +369,48 @@ void WatchmanBackend::start() {
 
     // Attempt to read from the socket.
     // If there is an error and we are stopped, break.
-    BSER b;
+    //
+    // File records are turned into events as they are read once we know which
+    // watcher they are for. Watchman doesn't order the keys of a PDU, so records
+    // that come before the subscription name are kept until it is read.
+    WatcherRef watcher;
+    bool isSubscription = false;
+    files.clear();
     try {
-      b = watchmanRead(&*mIPC);
+      mReader.read(doc, "files", [&] (std::string_view key, BSERView value) {
+        if (key != "subscription") {
+          return;
+        }
+
+        isSubscription = true;
+        watcher = findSubscription(value.stringValue());
+        if (watcher) {
+          for (auto &file : files) {
+            handleFile(watcher, file);
+          }
+        }
+
+        files.clear();
+      }, [&] (BSERView file) {
+        if (watcher) {
+          handleFile(watcher, file);
+        } else if (!isSubscription) {
+          files.push_back(WatchmanFile {
+            std::string(file.find("name").stringValue()),
+            file.find("mode").intValue(),
+            file.find("new").boolValue(),
+            file.find("exists").boolValue(),
+            readMetadata(file)
+          });
+        }
+      });
     } catch (std::exception &err) {
       if (mStopped) {
         break;
       } else if (mResponseSignal.isWaiting()) {
         mError = err.what();
         mResponseSignal.notify();
+        continue;
       } else {
         // Throwing causes the backend to be destroyed, but we never reach the code below to notify the signal
         mEndedSignal.notify();
@@ -195,20 +418,28 @@ void WatchmanBackend::start() {
       }
     }
 
-    auto obj = b.objectValue();
+    BSERView obj = doc.root();
     auto error = obj.find("error");
-    if (error != obj.end()) {
-      mError = error->second.stringValue();
+    if (error) {
+      mError = std::string(error.stringValue());
       mResponseSignal.notify();
       continue;
     }
 
-    // If this message is for a subscription, handle it, otherwise notify the request.
-    auto subscription = obj.find("subscription");
-    if (subscription != obj.end()) {
-      handleSubscription(obj);
+    // If this message is for a subscription, notify its watcher, otherwise notify the request.
+    if (isSubscription) {
+      if (!watcher) {
+        continue;
+      }
+
+      if (obj.find("files")) {
+        watcher->notify();
+      } else {
+        WatcherError err("Error reading changes from watchman", watcher);
+        handleWatcherError(err);
+      }
     } else {
-      mResponse = obj;
+      mResponse = std::move(doc);
       mResponseSignal.notify();
     }
   }
@@ -217,57 +448,150 @@ void WatchmanBackend::start() {
 }
 
 WatchmanBackend::~WatchmanBackend() {
-  // Mark the watcher as stopped, close the socket, and trigger the lock.
+  // Mark the watcher as stopped, shut down the socket, and trigger the lock.
   // This will cause the read loop to be broken and the thread to exit.
   mStopped = true;
-  mIPC.reset();
+  if (mIPC) {
+    mIPC->stop();
+  }
+
   mRequestSignal.notify();
 
-  // If not ended yet, wait.
+  // If not ended yet, wait. The socket is only closed once nothing reads it.
   mEndedSignal.wait();
+  mIPC.reset();
 }
 
-std::string WatchmanBackend::clock(WatcherRef watcher) {
-  BSER::Array cmd;
-  cmd.push_back("clock");
-  cmd.push_back(normalizePath(watcher->mDir));
+// Returns whether watchman's wildmatch only matches paths that the regex picomatch
+// made from the glob matches too, so they can be left out on watchman's side.
+// Syntax that picomatch treats differently, like braces, classes, extglobs,
+// negation and escapes, is left to the client.
+bool isWildmatchCompatible(const std::string &pattern) {
+  if (pattern.empty() || pattern[0] == '!' || pattern.rfind("./", 0) == 0 || pattern.back() == '/') {
+    return false;
+  }
 
-  BSER::Object obj = watchmanRequest(cmd);
-  auto found = obj.find("clock");
-  if (found == obj.end()) {
-    throw WatcherError("Error reading clock from watchman", watcher);
+  size_t segmentStart = 0;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    switch (pattern[i]) {
+      case '{': case '}': case '(': case ')': case '[': case ']':
+      case '!': case '+': case '@': case '\\':
+        return false;
+      case '/':
+        if (i == segmentStart) {
+          return false;
+        }
+
+        segmentStart = i + 1;
+        break;
+      case '?':
+        // Leading dots are matched differently.
+        if (i == segmentStart) {
+          return false;
+        }
+        break;
+      case '*':
+        if (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+          // A globstar is only the same when it is a whole segment.
+          if (i != segmentStart || (i + 2 < pattern.size() && pattern[i + 2] != '/')) {
+            return false;
+          }
+
+          i++;
+        }
+        break;
+    }
   }
 
-  return found->second.stringValue();
+  return true;
 }
 
-void WatchmanBackend::writeSnapshot(WatcherRef watcher, std::string *snapshotPath) {
-  std::unique_lock<std::mutex> lock(mMutex);
-  watchmanWatch(watcher->mDir);
+// The fields and expression shared by subscriptions and queries. Ignored paths,
+// and ignore globs that watchman can evaluate, are excluded on its side so their
+// records are never sent. Every record is still checked with isIgnored.
+BSER::Object watchmanQuery(WatcherRef watcher) {
+  BSER::Array fields;
+  fields.push_back("name");
+  fields.push_back("mode");
+  fields.push_back("exists");
+  fields.push_back("new");
+  if (watcher->mMetadata) {
+    fields.push_back("mtime_ms");
+    fields.push_back("size");
+    fields.push_back("ino");
+  }
+
+  BSER::Object query;
+  query.emplace("fields", fields);
+
+  BSER::Array anyOf;
+  anyOf.push_back("anyof");
+
+  std::string pathStart = watcher->mDir + DIR_SEP;
+  for (auto it = watcher->mIgnorePaths.begin(); it != watcher->mIgnorePaths.end(); it++) {
+    if (it->rfind(pathStart, 0) == 0) {
+      auto relative = it->substr(pathStart.size());
+      BSER::Array dirname;
+      dirname.push_back("dirname");
+      dirname.push_back(relative);
+      anyOf.push_back(dirname);
+    }
+  }
+
+  for (auto it = watcher->mIgnoreGlobs.begin(); it != watcher->mIgnoreGlobs.end(); it++) {
+    if (isWildmatchCompatible(it->mPattern)) {
+      BSER::Object flags;
+      flags.emplace("includedotfiles", true);
+
+      BSER::Array match;
+      match.push_back("match");
+      match.push_back(it->mPattern);
+      match.push_back("wholename");
+      match.push_back(flags);
+      anyOf.push_back(match);
+    }
+  }
 
+  if (anyOf.size() > 1) {
+    BSER::Array ignore;
+    ignore.push_back("not");
+    ignore.push_back(anyOf);
+    query.emplace("expression", ignore);
+    // Watchman matches case insensitively on case insensitive filesystems,
+    // but ignore paths and globs are case sensitive on our side.
+    query.emplace("case_sensitive", true);
+  }
+
+  return query;
+}
+
+void WatchmanBackend::writeSnapshot(WatcherRef watcher, std::string *snapshotPath) {
+  auto responses = watchmanCommands({watchCommand(watcher), clockCommand(watcher)});
   std::ofstream ofs(*snapshotPath);
-  ofs << clock(watcher);
+  ofs << readClock(watcher, responses[1]);
 }
 
 void WatchmanBackend::getEventsSince(WatcherRef watcher, std::string *snapshotPath) {
-  std::unique_lock<std::mutex> lock(mMutex);
   std::ifstream ifs(*snapshotPath);
   if (ifs.fail()) {
     return;
   }
 
-  watchmanWatch(watcher->mDir);
-
   std::string clock;
   ifs >> clock;
 
+  BSER::Object query = watchmanQuery(watcher);
+  query.emplace("since", clock);
+
   BSER::Array cmd;
-  cmd.push_back("since");
+  cmd.push_back("query");
   cmd.push_back(normalizePath(watcher->mDir));
-  cmd.push_back(clock);
+  cmd.push_back(query);
 
-  BSER::Object obj = watchmanRequest(cmd);
-  handleFiles(watcher, obj);
+  auto responses = watchmanCommands({watchCommand(watcher), cmd}, watcher);
+  if (!responses[1].root().find("files")) {
+    throw WatcherError("Error reading changes from watchman", watcher);
+  }
 }
 
 std::string getId(WatcherRef watcher) {
@@ -277,59 +601,53 @@ std::string getId(WatcherRef watcher) {
   return id.str();
 }
 
-// This function is called by Backend::watch which takes a lock on mMutex
-void WatchmanBackend::subscribe(WatcherRef watcher) {
-  watchmanWatch(watcher->mDir);
+// Watches the directory and gets the clock to subscribe from without a lock on mMutex.
+std::shared_ptr<PreparedSubscription> WatchmanBackend::prepareSubscribe(WatcherRef watcher) {
+  auto responses = watchmanCommands({watchCommand(watcher), clockCommand(watcher)});
+  auto prepared = std::make_shared<WatchmanPreparedSubscription>();
+  prepared->clock = readClock(watcher, responses[1]);
+  return prepared;
+}
 
+// This function is called by Backend::watch which takes a lock on mMutex
+ScanStats WatchmanBackend::completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) {
+  auto sub = std::static_pointer_cast<WatchmanPreparedSubscription>(prepared);
   std::string id = getId(watcher);
   BSER::Array cmd;
   cmd.push_back("subscribe");
   cmd.push_back(normalizePath(watcher->mDir));
   cmd.push_back(id);
 
-  BSER::Array fields;
-  fields.push_back("name");
-  fields.push_back("mode");
-  fields.push_back("exists");
-  fields.push_back("new");
-
-  BSER::Object opts;
-  opts.emplace("fields", fields);
-  opts.emplace("since", clock(watcher));
-
-  if (watcher->mIgnorePaths.size() > 0) {
-    BSER::Array ignore;
-    BSER::Array anyOf;
-    anyOf.push_back("anyof");
-
-    for (auto it = watcher->mIgnorePaths.begin(); it != watcher->mIgnorePaths.end(); it++) {
-      std::string pathStart = watcher->mDir + DIR_SEP;
-      if (it->rfind(pathStart, 0) == 0) {
-        auto relative = it->substr(pathStart.size());
-        BSER::Array dirname;
-        dirname.push_back("dirname");
-        dirname.push_back(relative);
-        anyOf.push_back(dirname);
-      }
-    }
+  BSER::Object opts = watchmanQuery(watcher);
+  opts.emplace("since", sub->clock);
+  opts.emplace("defer_vcs", watcher->mDeferVcs);
 
-    ignore.push_back("not");
-    ignore.push_back(anyOf);
+  cmd.push_back(opts);
+  subscriptionRequest(cmd);
 
-    opts.emplace("expression", ignore);
+  {
+    std::unique_lock<std::mutex> lock(mSubscriptionsMutex);
+    mSubscriptions.emplace(id, watcher);
   }
 
-  cmd.push_back(opts);
-  watchmanRequest(cmd);
-
-  mSubscriptions.emplace(id, watcher);
   mRequestSignal.notify();
+
+  // Watchman crawls the directory itself.
+  return ScanStats();
+}
+
+void WatchmanBackend::subscribe(WatcherRef watcher) {
+  completeSubscribe(watcher, prepareSubscribe(watcher));
 }
 
 // This function is called by Backend::unwatch which takes a lock on mMutex
 void WatchmanBackend::unsubscribe(WatcherRef watcher) {
   std::string id = getId(watcher);
-  auto erased = mSubscriptions.erase(id);
+  size_t erased;
+  {
+    std::unique_lock<std::mutex> lock(mSubscriptionsMutex);
+    erased = mSubscriptions.erase(id);
+  }
 
   if (erased) {
     BSER::Array cmd;
@@ -337,6 +655,6 @@ void WatchmanBackend::unsubscribe(WatcherRef watcher) {
     cmd.push_back(normalizePath(watcher->mDir));
     cmd.push_back(id);
 
-    watchmanRequest(cmd);
+    subscriptionRequest(cmd);
   }
 }
@@ -6,30 +6,71 @@
 #include "../Signal.hh"
 #include "./IPC.hh"
 
+// A file record from watchman that has been read before its watcher is known.
+struct WatchmanFile {
+  std::string name;
+  int64_t mode;
+  bool isNew;
+  bool exists;
+  std::optional<EventMetadata> metadata;
+};
+
+// A connection for commands, with its own read buffer. Watchman answers the
+// commands on a connection in the order they were sent.
+struct WatchmanConnection {
+  std::unique_ptr<IPC> ipc;
+  BSERReader reader;
+  // Reused to encode the commands sent on this connection.
+  std::string commands;
+  // Whether anything was read since the commands were written.
+  bool received;
+
+  WatchmanConnection(std::unique_ptr<IPC> conn) : ipc(std::move(conn)), reader([this] (char *buf, size_t len) {
+    size_t r = (size_t)ipc->read(buf, len);
+    received = true;
+    return r;
+  }), received(false) {}
+};
+
+class WatchmanPreparedSubscription : public PreparedSubscription {
+public:
+  std::string clock;
+};
+
 class WatchmanBackend : public Backend {
 public:
   static bool checkAvailable();
   void start() override;
-  WatchmanBackend() : mStopped(false) {};
+  WatchmanBackend() : mReader([this] (char *buf, size_t len) {
+    return (size_t)mIPC->read(buf, len);
+  }), mStopped(false) {};
   ~WatchmanBackend();
   void writeSnapshot(WatcherRef watcher, std::string *snapshotPath) override;
   void getEventsSince(WatcherRef watcher, std::string *snapshotPath) override;
   void subscribe(WatcherRef watcher) override;
   void unsubscribe(WatcherRef watcher) override;
+  std::shared_ptr<PreparedSubscription> prepareSubscribe(WatcherRef watcher) override;
+  ScanStats completeSubscribe(WatcherRef watcher, std::shared_ptr<PreparedSubscription> prepared) override;
 private:
+  // The connection subscriptions are made on. Watchman sends their changes on it
+  // unprompted, so it is only read by the backend thread.
   std::unique_ptr<IPC> mIPC;
+  BSERReader mReader;
   Signal mRequestSignal;
   Signal mResponseSignal;
-  BSER::Object mResponse;
+  BSERDocument mResponse;
   std::string mError;
+  std::mutex mSubscriptionsMutex;
   std::unordered_map<std::string, WatcherRef> mSubscriptions;
+  // Idle connections for all other commands.
+  std::mutex mConnectionsMutex;
+  std::vector<std::unique_ptr<WatchmanConnection>> mConnections;
   bool mStopped;
   Signal mEndedSignal;
 
-  std::string clock(WatcherRef watcher);
-  void watchmanWatch(std::string dir);
-  BSER::Object watchmanRequest(BSER cmd);
-  void handleSubscription(BSER::Object obj);
+  std::vector<BSERDocument> watchmanCommands(std::vector<BSER> cmds, WatcherRef watcher = nullptr);
+  BSERDocument subscriptionRequest(BSER cmd);
+  WatcherRef findSubscription(std::string_view id);
 };
 
 #endif
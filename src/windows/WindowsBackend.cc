@@ -9,7 +9,7 @@
 #define NETWORK_BUF_SIZE 64 * 1024
 #define CONVERT_TIME(ft) ULARGE_INTEGER{ft.dwLowDateTime, ft.dwHighDateTime}.QuadPart
 
-void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree) {
+void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tree, ScanStats *stats) {
   std::stack<std::string> directories;
 
   directories.push(watcher->mDir);
@@ -41,9 +41,18 @@ void BruteForceBackend::readTree(WatcherRef watcher, std::shared_ptr<DirTree> tr
           continue;
         }
 
+        if (!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !watcher->isIncluded(fullPath)) {
+          continue;
+        }
+
         tree->add(fullPath, CONVERT_TIME(ffd.ftLastWriteTime), ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
         if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
           directories.push(fullPath);
+          if (stats) {
+            stats->directories++;
+          }
+        } else if (stats) {
+          stats->files++;
         }
       }
     } while (FindNextFile(hFind, &ffd) != 0);
@@ -527,6 +527,31 @@ describe('since', () => {
         });
       });
 
+      describe('include', () => {
+        it('should only emit events for included globs', async () => {
+          let dir = getFilename();
+          let f1 = path.join(dir, 'test.ts');
+          let f2 = path.join(dir, 'test.js');
+          let include = [`${path.basename(dir)}/*.ts`];
+          await fs.mkdir(dir);
+          await sleep();
+          await watcher.writeSnapshot(tmpDir, snapshotPath, {backend, include});
+          if (isSecondPrecision) {
+            await sleep(1000);
+          }
+
+          await fs.writeFile(f1, 'hello');
+          await fs.writeFile(f2, 'sup');
+          await sleep();
+
+          let res = await watcher.getEventsSince(tmpDir, snapshotPath, {
+            backend,
+            include,
+          });
+          assert.deepEqual(res, [{type: 'create', path: f1}]);
+        });
+      });
+
       describe('errors', () => {
         it('should error if the watched directory does not exist', async () => {
           let dir = path.join(
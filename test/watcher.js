@@ -1,7 +1,7 @@
 const assert = require('assert');
 const fs = require('fs-extra');
 const path = require('path');
-const {execSync} = require('child_process');
+const {execSync, spawn} = require('child_process');
 const {Worker} = require('worker_threads');
 
 let watcher, watcherNative;
@@ -11,6 +11,10 @@ if (process.platform === 'darwin') {
   backends = ['fs-events', 'kqueue', 'watchman'];
 } else if (process.platform === 'linux') {
   backends = ['inotify', 'watchman'];
+  // fanotify needs CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH, e.g. running as root.
+  if (hasCapabilities([21, 2])) {
+    backends.push('fanotify');
+  }
 } else if (process.platform === 'win32') {
   backends = ['windows', 'watchman'];
 } else if (process.platform === 'freebsd') {
@@ -21,6 +25,15 @@ if (process.env.TEST_WASM) {
   backends = ['wasm'];
 }
 
+// Checks the effective capabilities of the process on Linux.
+function hasCapabilities(caps) {
+  let status = fs.readFileSync('/proc/self/status', 'utf8');
+  let match = /^CapEff:\s*([0-9a-f]+)$/m.exec(status);
+  // All of the checked capabilities are in the low 32 bits.
+  let effective = match ? parseInt(match[1].slice(-8), 16) : 0;
+  return caps.every((cap) => (effective & (1 << cap)) !== 0);
+}
+
 describe('watcher', () => {
   backends.forEach((backend) => {
     describe(backend, () => {
@@ -54,6 +67,155 @@ describe('watcher', () => {
           ...dir,
           `test${c++}${Math.random().toString(31).slice(2)}`,
         );
+
+      // Tests with their own subscriptions watch a directory outside tmpDir,
+      // with the given sub-directories and files. The directories and
+      // subscriptions are removed after each test.
+      let testDirs = [];
+      let testSubs = [];
+      const createDir = async (dirs = [], files = {}) => {
+        let dir = path.join(
+          fs.realpathSync(require('os').tmpdir()),
+          Math.random().toString(31).slice(2),
+        );
+        testDirs.push(dir);
+        fs.mkdirpSync(dir);
+        for (let d of dirs) {
+          fs.mkdirpSync(path.join(dir, d));
+        }
+        for (let [f, contents] of Object.entries(files)) {
+          fs.writeFileSync(path.join(dir, f), contents);
+        }
+        await new Promise((resolve) => setTimeout(resolve, 100));
+        return dir;
+      };
+
+      // `next` resolves with the events of the next callback that wasn't
+      // read yet. Callbacks that happened before are kept in `queued`.
+      const subscribeDir = async (dir, opts = {}) => {
+        let queued = [];
+        let waiting = [];
+        let s = await watcher.subscribe(
+          dir,
+          (err, events) => {
+            let result = {err, events};
+            if (waiting.length > 0) {
+              waiting.shift()(result);
+            } else {
+              queued.push(result);
+            }
+          },
+          {backend, ...opts},
+        );
+        testSubs.push(s);
+        s.queued = queued;
+        s.next = async () => {
+          let {err, events} =
+            queued.length > 0
+              ? queued.shift()
+              : await new Promise((resolve) => waiting.push(resolve));
+          if (err) {
+            throw err;
+          }
+          return events;
+        };
+        return s;
+      };
+
+      // Subscribes in a child process, so that internal limits can be lowered
+      // with environment variables without affecting other tests. Callbacks
+      // are queued like with subscribeDir. `nextResult` resolves with the
+      // error message along with the events.
+      let testProcesses = [];
+      const subscribeInProcess = async (dir, opts, env) => {
+        let child = spawn(
+          process.execPath,
+          [
+            '-e',
+            `
+            const [modulePath, dir, opts] = process.argv.slice(1);
+            require(modulePath)
+              .subscribe(
+                dir,
+                (err, events) => {
+                  process.send({error: err ? err.message : null, events});
+                },
+                JSON.parse(opts),
+              )
+              .then(
+                () => process.send({error: null}),
+                (err) => process.send({error: err.message}),
+              );
+            `,
+            require.resolve('../'),
+            dir,
+            JSON.stringify({backend, ...opts}),
+          ],
+          {
+            env: {...process.env, ...env},
+            stdio: ['ignore', 'inherit', 'inherit', 'ipc'],
+          },
+        );
+        testProcesses.push(child);
+
+        let queued = [];
+        let waiting = [];
+        let push = (result) => {
+          if (waiting.length > 0) {
+            waiting.shift()(result);
+          } else {
+            queued.push(result);
+          }
+        };
+        child.on('message', push);
+        child.on('exit', (code) => {
+          while (waiting.length > 0) {
+            push({error: `Exited with code ${code}`, events: []});
+          }
+        });
+
+        let s = {queued};
+        s.nextResult = () =>
+          queued.length > 0
+            ? Promise.resolve(queued.shift())
+            : new Promise((resolve) => waiting.push(resolve));
+        s.next = async () => {
+          let {error, events} = await s.nextResult();
+          if (error) {
+            throw new Error(error);
+          }
+          return events;
+        };
+
+        // The first message is sent once the subscription is ready.
+        await s.next();
+        return s;
+      };
+
+      // Reads callbacks until there are at least `count` events.
+      const nextEvents = async (s, count) => {
+        let events = [];
+        while (events.length < count) {
+          events.push(...(await s.next()));
+        }
+        return events.sort((a, b) => a.path.localeCompare(b.path));
+      };
+
+      afterEach(async () => {
+        for (let child of testProcesses) {
+          child.kill();
+        }
+        for (let s of testSubs) {
+          await s.unsubscribe();
+        }
+        for (let dir of testDirs) {
+          await fs.remove(dir);
+        }
+        testProcesses = [];
+        testSubs = [];
+        testDirs = [];
+      });
+
       let ignoreDir, ignoreFile, ignoreGlobDir, fileToRename, dirToRename, sub;
 
       before(async () => {
@@ -338,6 +500,33 @@ describe('watcher', () => {
           ]);
         });
 
+        it('should emit for the contents of a directory moved in', async () => {
+          if (backend !== 'inotify' && backend !== 'fanotify') {
+            return;
+          }
+          let src = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+          fs.mkdirpSync(path.join(src, 'sub'));
+          fs.writeFileSync(path.join(src, 'sub', 'test.txt'), 'hello');
+
+          let f1 = getFilename();
+          fs.rename(src, f1);
+          let res = await nextEvent();
+          res.sort((a, b) => a.path.localeCompare(b.path));
+          assert.deepEqual(res, [
+            {type: 'create', path: f1},
+            {type: 'create', path: path.join(f1, 'sub')},
+            {type: 'create', path: path.join(f1, 'sub', 'test.txt')},
+          ]);
+
+          let f2 = path.join(f1, 'sub', 'test2.txt');
+          fs.writeFile(f2, 'hello');
+          res = await nextEvent();
+          assert.deepEqual(res, [{type: 'create', path: f2}]);
+        });
+
         it('should emit when a sub-directory is deleted with files inside', async () => {
           let f1 = getFilename();
           let f2 = getFilename(path.basename(f1));
@@ -951,6 +1140,398 @@ describe('watcher', () => {
           );
         });
       });
+
+      describe('include', () => {
+        it('should only emit events for included paths', async () => {
+          if (backend === 'wasm') {
+            return;
+          }
+          let dir = await createDir(['src/sub', 'lib', 'docs']);
+          let sub = await subscribeDir(dir, {
+            include: ['src/**/*.ts', 'lib'],
+          });
+
+          // Paths that aren't included are changed first, so that they would
+          // have been reported by the time the included ones are.
+          fs.writeFileSync(path.join(dir, 'src', 'test.js'), 'hello');
+          fs.writeFileSync(path.join(dir, 'docs', 'test.ts'), 'hello');
+          fs.mkdirpSync(path.join(dir, 'src', 'other'));
+          fs.writeFileSync(path.join(dir, 'src', 'test.ts'), 'hello');
+          fs.writeFileSync(path.join(dir, 'src', 'sub', 'test.ts'), 'hello');
+          fs.writeFileSync(path.join(dir, 'lib', 'test.js'), 'hello');
+
+          let events = [];
+          while (events.length < 3) {
+            events.push(...(await sub.next()));
+          }
+
+          events.sort((a, b) => a.path.localeCompare(b.path));
+          assert.deepEqual(events, [
+            {type: 'create', path: path.join(dir, 'lib', 'test.js')},
+            {type: 'create', path: path.join(dir, 'src', 'sub', 'test.ts')},
+            {type: 'create', path: path.join(dir, 'src', 'test.ts')},
+          ]);
+        });
+      });
+
+      describe('renamed directories', () => {
+        it('should emit events under the new path', async () => {
+          if (backend === 'wasm') {
+            return;
+          }
+          let dir = await createDir(['src/a/b']);
+          let sub = await subscribeDir(dir);
+
+          fs.renameSync(path.join(dir, 'src'), path.join(dir, 'lib'));
+          await sub.next();
+
+          let f = path.join(dir, 'lib', 'a', 'b', 'test.js');
+          fs.writeFileSync(f, 'hi');
+          assert.deepEqual(await sub.next(), [{type: 'create', path: f}]);
+        });
+
+        it('should apply ignore globs to the contents under the new path', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+          let dir = await createDir(['src/a/b'], {
+            'src/a/debug.log': 'hi',
+            'src/a/notes.txt': 'hi',
+          });
+          let sub = await subscribeDir(dir, {
+            ignore: ['src/**/*.log', 'lib/**/*.txt'],
+          });
+
+          fs.renameSync(path.join(dir, 'src'), path.join(dir, 'lib'));
+          let events = await sub.next();
+          events.sort((a, b) => a.path.localeCompare(b.path));
+          assert.deepEqual(events, [
+            {type: 'create', path: path.join(dir, 'lib')},
+            {type: 'create', path: path.join(dir, 'lib', 'a', 'debug.log')},
+            {type: 'delete', path: path.join(dir, 'src')},
+          ]);
+
+          // The ignored file is written first, so it would be in this batch.
+          fs.writeFileSync(path.join(dir, 'lib', 'a', 'notes.txt'), 'hello');
+          let f = path.join(dir, 'lib', 'a', 'b', 'test.js');
+          fs.writeFileSync(f, 'hi');
+          assert.deepEqual(await sub.next(), [{type: 'create', path: f}]);
+        });
+      });
+
+      describe('background', () => {
+        it('should resolve ready with scan stats', async () => {
+          if (backend === 'wasm') {
+            return;
+          }
+          let dir = await createDir(['a/b'], {'a/test.txt': 'hello'});
+          let sub = await subscribeDir(dir, {background: true});
+
+          let stats = await sub.ready;
+          assert.equal(typeof stats.duration, 'number');
+          if (backend === 'inotify' || backend === 'fanotify') {
+            assert.equal(stats.files, 1);
+            assert.equal(stats.directories, 3);
+          }
+
+          let f = path.join(dir, 'a', 'b', 'test.txt');
+          fs.writeFileSync(f, 'hello');
+          assert.deepEqual(await sub.next(), [{type: 'create', path: f}]);
+        });
+
+        it('should reject ready if the directory does not exist', async () => {
+          if (backend === 'wasm') {
+            return;
+          }
+          let dir = path.join(
+            fs.realpathSync(require('os').tmpdir()),
+            Math.random().toString(31).slice(2),
+          );
+
+          let sub = await watcher.subscribe(dir, () => {}, {
+            backend,
+            background: true,
+          });
+          await assert.rejects(sub.ready);
+        });
+
+        it('should keep emitting for other subscriptions while crawling', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+          let dirs = [];
+          for (let i = 0; i < 50; i++) {
+            for (let j = 0; j < 50; j++) {
+              dirs.push(path.join('d' + i, 'e' + j));
+            }
+          }
+          let dir = await createDir(dirs);
+
+          // Every crawled entry is checked against each ignore path, which
+          // keeps the crawl running for well over the debounce delay.
+          let ignore = [];
+          for (let i = 0; i < 5000; i++) {
+            ignore.push(path.join(dir, 'ignored', String(i)));
+          }
+
+          let sub = await subscribeDir(dir, {background: true, ignore});
+          let isReady = false;
+          let ready = sub.ready.then(() => {
+            isReady = true;
+          });
+
+          let f = getFilename();
+          fs.writeFileSync(f, 'hello');
+          let res = await nextEvent();
+          assert.deepEqual(res, [{type: 'create', path: f}]);
+          assert(!isReady, 'Expected the crawl to still be running');
+          await ready;
+        });
+      });
+
+      describe('shards', () => {
+        it('should emit events for directories spread across instances', async () => {
+          if (backend === 'wasm') {
+            return;
+          }
+
+          let dirs = [];
+          let subs = [];
+          for (let i = 0; i < 4; i++) {
+            dirs.push(await createDir());
+          }
+          for (let dir of dirs) {
+            subs.push(await subscribeDir(dir, {shards: 4}));
+          }
+
+          for (let dir of dirs) {
+            fs.writeFileSync(path.join(dir, 'test.txt'), 'hello');
+          }
+
+          for (let i = 0; i < dirs.length; i++) {
+            assert.deepEqual(await subs[i].next(), [
+              {type: 'create', path: path.join(dirs[i], 'test.txt')},
+            ]);
+          }
+        });
+      });
+
+      describe('polling fallback', () => {
+        it('should emit events for watched directories', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          let dir = await createDir(['a']);
+          let sub = await subscribeDir(dir, {pollingFallback: true});
+
+          let f = path.join(dir, 'a', 'test.txt');
+          fs.writeFileSync(f, 'hello');
+          assert.deepEqual(await sub.next(), [{type: 'create', path: f}]);
+        });
+
+        it('should poll directories over the budget', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          // Only the root fits in the budget, so everything below it is polled.
+          let dir = await createDir(['a/b/c']);
+          let sub = await subscribeInProcess(
+            dir,
+            {pollingFallback: true},
+            {PARCEL_WATCHER_INOTIFY_WATCH_BUDGET: '1'},
+          );
+
+          let f = path.join(dir, 'a', 'b', 'c', 'test.txt');
+          let d = path.join(dir, 'a', 'b', 'd');
+          fs.writeFileSync(f, 'hello');
+          fs.mkdirSync(d);
+          assert.deepEqual(await nextEvents(sub, 2), [
+            {type: 'create', path: f},
+            {type: 'create', path: d},
+          ]);
+
+          fs.unlinkSync(f);
+          fs.rmdirSync(d);
+          assert.deepEqual(await nextEvents(sub, 2), [
+            {type: 'delete', path: f},
+            {type: 'delete', path: d},
+          ]);
+        });
+
+        // With a budget of two watches, the root and `a` are watched, and `b`
+        // is polled once it is created. Changes in `b` then switch it to
+        // inotify in place of `a`, which didn't have any events.
+        const balanceWatches = async () => {
+          let dir = await createDir(['a'], {'a/test.txt': 'hello'});
+          let sub = await subscribeInProcess(
+            dir,
+            {pollingFallback: true},
+            {PARCEL_WATCHER_INOTIFY_WATCH_BUDGET: '2'},
+          );
+
+          let b = path.join(dir, 'b');
+          fs.mkdirSync(b);
+          assert.deepEqual(await sub.next(), [{type: 'create', path: b}]);
+
+          let f = path.join(b, 'test.txt');
+          fs.writeFileSync(f, 'hello');
+          assert.deepEqual(await sub.next(), [{type: 'create', path: f}]);
+          return {dir, sub};
+        };
+
+        it('should switch active polled directories to inotify', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          let {dir, sub} = await balanceWatches();
+
+          // Polled directories only read existing files again after 16s, so
+          // the update is only reported in time if the directory is watched.
+          let f = path.join(dir, 'b', 'test.txt');
+          fs.writeFileSync(f, 'world');
+          let events = await Promise.race([
+            sub.next(),
+            new Promise((resolve) => setTimeout(resolve, 4000)),
+          ]);
+          assert.deepEqual(events, [{type: 'update', path: f}]);
+        });
+
+        it('should poll quiet watched directories in their place', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          let {dir, sub} = await balanceWatches();
+
+          // Let the first poll of `a` read it. After that, an update to an
+          // existing file is only found once an entry is added.
+          await new Promise((resolve) => setTimeout(resolve, 2500));
+          let f = path.join(dir, 'a', 'test.txt');
+          fs.writeFileSync(f, 'world');
+          await new Promise((resolve) => setTimeout(resolve, 3000));
+          assert.deepEqual(sub.queued, []);
+
+          let created = path.join(dir, 'a', 'new.txt');
+          fs.writeFileSync(created, 'hello');
+          assert.deepEqual(await nextEvents(sub, 2), [
+            {type: 'create', path: created},
+            {type: 'update', path: f},
+          ]);
+        });
+      });
+
+      describe('resync', () => {
+        it('should report the changes found by a resync with an error', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          // Every event is dropped like after a queue overflow, so changes
+          // are only found by re-scanning the directory.
+          let dir = await createDir([], {
+            'update.txt': 'hello',
+            'delete.txt': 'hello',
+          });
+          let sub = await subscribeInProcess(
+            dir,
+            {},
+            {PARCEL_WATCHER_INOTIFY_MAX_QUEUED_BYTES: '0'},
+          );
+
+          // A resync may run between the changes, so a path can be reported
+          // more than once. Only its first event is kept.
+          let found = new Map();
+          const nextResynced = async (count) => {
+            while (found.size < count) {
+              let {error, events} = await sub.nextResult();
+              assert(/re-scanning/.test(error), error);
+              for (let event of events) {
+                if (!found.has(event.path)) {
+                  found.set(event.path, event.type);
+                }
+              }
+            }
+            return [...found].sort();
+          };
+
+          let created = path.join(dir, 'create.txt');
+          let updated = path.join(dir, 'update.txt');
+          let deleted = path.join(dir, 'delete.txt');
+          fs.writeFileSync(created, 'hello');
+          fs.writeFileSync(updated, 'world');
+          fs.unlinkSync(deleted);
+          assert.deepEqual(await nextResynced(3), [
+            [created, 'create'],
+            [deleted, 'delete'],
+            [updated, 'update'],
+          ]);
+
+          // The subscription keeps working after a resync.
+          let later = path.join(dir, 'later.txt');
+          fs.writeFileSync(later, 'hello');
+          assert.deepEqual(await nextResynced(4), [
+            [created, 'create'],
+            [deleted, 'delete'],
+            [later, 'create'],
+            [updated, 'update'],
+          ]);
+        });
+      });
+
+      describe('completed writes', () => {
+        it('should only emit an update once the file is closed', async () => {
+          if (backend !== 'inotify') {
+            return;
+          }
+
+          let f = getFilename();
+          fs.writeFileSync(f, 'hello');
+          await new Promise((resolve) => setTimeout(resolve, 100));
+
+          let sub = await subscribeDir(tmpDir, {completedWrites: true});
+          let fd = fs.openSync(f, 'a');
+          try {
+            fs.writeSync(fd, 'world');
+            await new Promise((resolve) => setTimeout(resolve, 200));
+            assert.deepEqual(sub.queued, []);
+
+            fs.writeSync(fd, '!');
+          } finally {
+            fs.closeSync(fd);
+          }
+
+          assert.deepEqual(await sub.next(), [{type: 'update', path: f}]);
+        });
+      });
+
+      describe('metadata', () => {
+        it('should include file metadata in events', async () => {
+          if (backend !== 'watchman') {
+            return;
+          }
+
+          let dir = await createDir();
+          let sub = await subscribeDir(dir, {metadata: true});
+
+          let f = path.join(dir, 'test.txt');
+          fs.writeFileSync(f, 'hello');
+          let res = await sub.next();
+
+          let stat = fs.statSync(f);
+          assert.deepEqual(res, [
+            {
+              type: 'create',
+              path: f,
+              mtimeMs: Math.floor(stat.mtimeMs),
+              size: 5,
+              ino: stat.ino,
+            },
+          ]);
+        });
+      });
     });
   });
 
@@ -0,0 +1,404 @@
+const assert = require('assert');
+const fs = require('fs-extra');
+const os = require('os');
+const path = require('path');
+const {FakeWatchman, encode} = require('../benchmark/fake-watchman');
+
+// Tests the watchman backend against the fake watchman server in benchmark/,
+// which can send records and malformed data that a real watchman rarely does.
+const describeNative = process.env.TEST_WASM ? describe.skip : describe;
+
+describeNative('watchman', () => {
+  const sockPath =
+    process.platform === 'win32'
+      ? `\\\\.\\pipe\\parcel-watcher-test-${process.pid}`
+      : path.join(os.tmpdir(), `parcel-watcher-test-${process.pid}.sock`);
+  const defaults = {
+    templates: false,
+    chunk: 0,
+    filesFirst: false,
+    filter: false,
+  };
+
+  let watcher, server, prevSock, tmpDir;
+  let subs = [];
+
+  before(async () => {
+    watcher = require('../');
+    server = new FakeWatchman();
+    await server.listen(sockPath);
+
+    // The socket path is read whenever the backend connects, and the backend
+    // is dropped once it has no subscriptions, so this doesn't affect others.
+    prevSock = process.env.WATCHMAN_SOCK;
+    process.env.WATCHMAN_SOCK = sockPath;
+
+    tmpDir = path.join(
+      fs.realpathSync(os.tmpdir()),
+      Math.random().toString(31).slice(2),
+    );
+    fs.mkdirpSync(tmpDir);
+  });
+
+  afterEach(async () => {
+    for (let sub of subs) {
+      await sub.unsubscribe();
+    }
+    subs = [];
+    Object.assign(server.options, defaults);
+  });
+
+  after(async () => {
+    if (prevSock === undefined) {
+      delete process.env.WATCHMAN_SOCK;
+    } else {
+      process.env.WATCHMAN_SOCK = prevSock;
+    }
+
+    await server.close();
+    await fs.remove(tmpDir);
+  });
+
+  let c = 0;
+  const getDir = () => {
+    let dir = path.join(tmpDir, `dir${c++}`);
+    fs.mkdirpSync(dir);
+    return dir;
+  };
+
+  // Subscribes to a new directory. `next` resolves with the error or events
+  // of the next callback. Subscriptions that error are already removed, so
+  // only the others are unsubscribed after each test.
+  async function subscribe(options = {}) {
+    let dir = getDir();
+    let cbs = [];
+    let sub = await watcher.subscribe(
+      dir,
+      (err, events) => {
+        setImmediate(() => {
+          for (let cb of cbs) {
+            cb({err, events});
+          }
+          cbs = [];
+        });
+      },
+      {backend: 'watchman', ...options},
+    );
+
+    let name = [...server.subscriptions].find(
+      ([, s]) => path.normalize(s.root) === dir,
+    )[0];
+    let result = {
+      dir,
+      name,
+      next: () => new Promise((resolve) => cbs.push(resolve)),
+      errored: async () => {
+        let {err} = await result.next();
+        assert(err, 'Expected an error');
+        subs.splice(subs.indexOf(sub), 1);
+        return err;
+      },
+    };
+    subs.push(sub);
+    return result;
+  }
+
+  const file = (name, fields = {}) => ({
+    name,
+    mode: 0o100644,
+    exists: true,
+    new: true,
+    ...fields,
+  });
+
+  const sorted = (events) =>
+    [...events].sort((a, b) => (a.path < b.path ? -1 : 1));
+
+  describe('decoding', () => {
+    it('should read records from templates with skipped fields', async () => {
+      server.options.templates = true;
+      let {dir, name, next} = await subscribe({metadata: true});
+      server.push(
+        [
+          file('a.js', {mtime_ms: 1000, size: 10, ino: 1}),
+          // Watchman skips fields it has no value for, e.g. `new` for an
+          // existing file and metadata for a file it couldn't stat.
+          {name: 'b.js', mode: 0o100644, exists: true, mtime_ms: 2000},
+          file('c.js'),
+        ],
+        {subscription: name},
+      );
+
+      let {err, events} = await next();
+      assert(!err);
+      assert.deepEqual(sorted(events), [
+        {
+          path: path.join(dir, 'a.js'),
+          type: 'create',
+          mtimeMs: 1000,
+          size: 10,
+          ino: 1,
+        },
+        {
+          path: path.join(dir, 'b.js'),
+          type: 'update',
+          mtimeMs: 2000,
+          size: 0,
+          ino: 0,
+        },
+        {path: path.join(dir, 'c.js'), type: 'create'},
+      ]);
+    });
+
+    it('should read PDUs split across reads', async () => {
+      server.options.chunk = 7;
+      let {dir, name, next} = await subscribe();
+      let names = [];
+      for (let i = 0; i < 20; i++) {
+        names.push(`dir${i}/${'x'.repeat(i * 10)}.js`);
+      }
+
+      server.push(names.map((n) => file(n)), {subscription: name});
+      server.push([file('last.js')], {subscription: name});
+
+      let events = [];
+      while (!events.some((e) => e.path === path.join(dir, 'last.js'))) {
+        let res = await next();
+        assert(!res.err);
+        events.push(...res.events);
+      }
+
+      assert.deepEqual(
+        events.map((e) => e.path).sort(),
+        [...names, 'last.js'].map((n) => path.join(dir, n)).sort(),
+      );
+    });
+
+    it('should read negative and 64-bit integers', async () => {
+      let {dir, name, next} = await subscribe({metadata: true});
+      server.push(
+        [
+          file('a.js', {mtime_ms: -5, size: 2 ** 40, ino: 2 ** 40 + 5}),
+          file('b.js', {mtime_ms: -40000, size: 0x7fffffff, ino: 2 ** 31}),
+        ],
+        {subscription: name},
+      );
+
+      let {err, events} = await next();
+      assert(!err);
+      assert.deepEqual(sorted(events), [
+        {
+          path: path.join(dir, 'a.js'),
+          type: 'create',
+          mtimeMs: -5,
+          size: 2 ** 40,
+          ino: 2 ** 40 + 5,
+        },
+        {
+          path: path.join(dir, 'b.js'),
+          type: 'create',
+          mtimeMs: -40000,
+          size: 0x7fffffff,
+          ino: 2 ** 31,
+        },
+      ]);
+    });
+
+    it('should error on a truncated PDU', async () => {
+      let {name, errored} = await subscribe();
+      let pdu = encode(
+        server.subscriptionPDU(name, '/', [file('a.js'), file('b.js')]),
+      );
+
+      server.writeRaw(pdu.subarray(0, pdu.length - 10), {end: true});
+      await errored();
+    });
+
+    it('should error on corrupt lengths', async () => {
+      // An object whose `subscription` string is longer than the PDU, and
+      // one with a negative number of entries.
+      let key = Buffer.from('subscription');
+      let bodies = [
+        Buffer.concat([
+          Buffer.from([0x01, 0x03, 0x01, 0x02, 0x03, key.length]),
+          key,
+          Buffer.from([0x02, 0x05, 0xff, 0xff, 0xff, 0x7f]),
+        ]),
+        Buffer.from([0x01, 0x03, 0xff]),
+      ];
+
+      for (let body of bodies) {
+        let {errored} = await subscribe();
+        server.writeRaw(
+          Buffer.concat([Buffer.from([0x00, 0x01, 0x03, body.length]), body]),
+        );
+
+        let err = await errored();
+        assert(/Invalid BSER length/.test(err.message), err.message);
+      }
+    });
+  });
+
+  describe('subscriptions', () => {
+    [false, true].forEach((filesFirst) => {
+      it(`should handle files ${filesFirst ? 'before' : 'after'} the subscription name`, async () => {
+        server.options.filesFirst = filesFirst;
+        let {dir, name, next} = await subscribe();
+        server.push([file('a.js'), file('b.js', {new: false})], {
+          subscription: name,
+        });
+
+        let {err, events} = await next();
+        assert(!err);
+        assert.deepEqual(sorted(events), [
+          {path: path.join(dir, 'a.js'), type: 'create'},
+          {path: path.join(dir, 'b.js'), type: 'update'},
+        ]);
+      });
+    });
+
+    it('should ignore PDUs for unknown subscriptions', async () => {
+      let {dir, name, next} = await subscribe();
+
+      // Records of an unknown subscription are dropped whether or not they
+      // were buffered before its name was read.
+      server.options.filesFirst = true;
+      server.push([file('x.js')], {subscription: 'unknown'});
+      server.options.filesFirst = false;
+      server.push([file('y.js')], {subscription: 'unknown'});
+      server.push([file('a.js')], {subscription: name});
+
+      let {err, events} = await next();
+      assert(!err);
+      assert.deepEqual(events, [
+        {path: path.join(dir, 'a.js'), type: 'create'},
+      ]);
+    });
+  });
+
+  describe('filtering', () => {
+    it('should emit the same events when watchman filters ignored files', async () => {
+      let {dir, name, next} = await subscribe({ignore: ['ign', '**/*.log']});
+      let records = [
+        'a.txt',
+        'keep.js',
+        '.env',
+        'ign/a.js',
+        // Ignore paths and globs are case sensitive on our side, even where
+        // watchman's matching isn't by default.
+        'IGN/b.js',
+        'DEBUG.LOG',
+        'sub/x.log',
+        'sub/.hidden.log',
+      ].map((n) => file(n));
+
+      let received = async () => {
+        let {err, events} = await next();
+        assert(!err);
+        return sorted(events).map((e) => path.relative(dir, e.path));
+      };
+
+      // Sent as is, so the backend filters every record itself.
+      server.push(records, {subscription: name});
+      let unfiltered = await received();
+
+      server.options.filter = true;
+      server.options.caseSensitive = false;
+      server.push(records, {subscription: name});
+      let filtered = await received();
+
+      assert.deepEqual(
+        unfiltered,
+        ['.env', 'DEBUG.LOG', 'IGN/b.js', 'a.txt', 'keep.js'].map(
+          path.normalize,
+        ),
+      );
+      assert.deepEqual(filtered, unfiltered);
+    });
+  });
+
+  describe('encoding', () => {
+    // Reads the length in a PDU header, and checks that it is the smallest
+    // integer type that fits, like the rest of the encoding.
+    const readHeader = (bytes) => {
+      assert.deepEqual([...bytes.subarray(0, 2)], [0x00, 0x01]);
+      let size = {0x03: 1, 0x04: 2, 0x05: 4}[bytes[2]];
+      assert(size, `Unexpected header type ${bytes[2]}`);
+      let length = bytes.readIntLE(3, size);
+      let expected = length <= 0x7f ? 1 : length <= 0x7fff ? 2 : 4;
+      assert.equal(size, expected);
+      return {length, size: 3 + size};
+    };
+
+    it('should encode commands like the reference encoder', async () => {
+      let commands = [];
+      let onCommand = (command) => commands.push(command);
+      server.on('command', onCommand);
+
+      // Ignore paths of different lengths are encoded with 8, 16 and 32 bit
+      // string lengths, and globs as nested match terms with a flags object.
+      let paths = ['c', 'a'.repeat(200), 'b'.repeat(70000)];
+      try {
+        await subscribe({ignore: [...paths, '**/*.log']});
+      } finally {
+        server.off('command', onCommand);
+      }
+
+      let sub = commands.find(({command}) => command[0] === 'subscribe');
+      assert(sub, 'Expected a subscribe command');
+      let [, , , query] = sub.command;
+      let [not, [anyof, ...terms]] = query.expression;
+      assert.equal(not, 'not');
+      assert.equal(anyof, 'anyof');
+      assert.deepEqual(
+        terms.map((term) => JSON.stringify(term)).sort(),
+        [
+          ...paths.map((p) => ['dirname', p]),
+          ['match', '**/*.log', 'wholename', {includedotfiles: true}],
+        ]
+          .map((term) => JSON.stringify(term))
+          .sort(),
+      );
+      assert.deepEqual(query.fields, ['name', 'mode', 'exists', 'new']);
+
+      for (let {command, bytes} of commands) {
+        let header = readHeader(bytes);
+        assert.equal(header.length, bytes.length - header.size);
+
+        // The reference encoder keeps the decoded key order and uses the
+        // smallest integer types, so the bodies must match byte for byte.
+        let body = bytes.subarray(header.size);
+        assert(
+          body.equals(encode(command).subarray(7)),
+          `Unexpected encoding of ${command[0]}`,
+        );
+      }
+
+      assert(sub.bytes.length > 0x7fff);
+    });
+  });
+
+  describe('connections', () => {
+    it('should reconnect when idle connections were closed', async () => {
+      // Keeps the backend, and so its idle connections, alive.
+      await subscribe();
+      let dir = getDir();
+      let snapshot = path.join(tmpDir, `snapshot${c++}.txt`);
+      await watcher.writeSnapshot(dir, snapshot, {backend: 'watchman'});
+
+      let connections = 0;
+      let onConnection = () => connections++;
+      server.server.on('connection', onConnection);
+      try {
+        server.closeIdle();
+        await fs.remove(snapshot);
+        await watcher.writeSnapshot(dir, snapshot, {backend: 'watchman'});
+      } finally {
+        server.server.off('connection', onConnection);
+      }
+
+      assert(await fs.pathExists(snapshot));
+      assert.equal(connections, 1);
+    });
+  });
+});
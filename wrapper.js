@@ -3,40 +3,20 @@ const picomatch = require('picomatch');
 const isGlob = require('is-glob');
 
 function normalizeOptions(dir, opts = {}) {
-  const {ignore, ...rest} = opts;
+  const {ignore, include, ...rest} = opts;
+  opts = rest;
 
   if (Array.isArray(ignore)) {
-    opts = {...rest};
-
     for (const value of ignore) {
-      if (value instanceof RegExp) {
-        if (value.flags !== '') {
-          throw new Error(
-            `RegExp ignore patterns must not have flags (got /${value.source}/${value.flags}). Flags are not supported by the native matcher.`,
-          );
-        }
-        if (!opts.ignoreGlobs) {
-          opts.ignoreGlobs = [];
-        }
-        // The native backend uses std::regex_match (full-string match), but
-        // callers expect JS .test() semantics (substring search). Wrapping the
-        // source in ^[\\s\\S]*(?:…)[\\s\\S]*$ achieves that. The (?:…) group
-        // isolates the source so leading/trailing | in the source stays contained.
-        opts.ignoreGlobs.push(`^[\\s\\S]*(?:${value.source})[\\s\\S]*$`);
-      } else if (isGlob(value)) {
+      if (value instanceof RegExp || isGlob(value)) {
         if (!opts.ignoreGlobs) {
           opts.ignoreGlobs = [];
+          opts.ignoreGlobPatterns = [];
         }
 
-        const regex = picomatch.makeRe(value, {
-          // We set `dot: true` to workaround an issue with the
-          // regular expression on Linux where the resulting
-          // negative lookahead `(?!(\\/|^)` was never matching
-          // in some cases. See also https://bit.ly/3UZlQDm
-          dot: true,
-          windows: process.platform === 'win32',
-        });
-        opts.ignoreGlobs.push(regex.source);
+        opts.ignoreGlobs.push(toRegexSource(value));
+        // Lets the watchman backend filter on its side when it can.
+        opts.ignoreGlobPatterns.push(value instanceof RegExp ? null : value);
       } else {
         if (!opts.ignorePaths) {
           opts.ignorePaths = [];
@@ -47,9 +27,63 @@ function normalizeOptions(dir, opts = {}) {
     }
   }
 
+  if (Array.isArray(include)) {
+    opts.includeGlobs = [];
+    // Directories that may contain matches. Everything else is pruned natively.
+    opts.includeDirs = [];
+
+    for (const value of include) {
+      if (value instanceof RegExp) {
+        opts.includeGlobs.push(toRegexSource(value));
+        opts.includeDirs.push(path.resolve(dir));
+      } else if (isGlob(value)) {
+        opts.includeGlobs.push(toRegexSource(value));
+        opts.includeDirs.push(path.resolve(dir, picomatch.scan(value).base));
+      } else {
+        // A path includes itself and everything inside it.
+        const resolved = path.resolve(dir, value);
+        const relative = escapeRegex(path.relative(path.resolve(dir), resolved));
+        const sep = escapeRegex(path.sep);
+        opts.includeGlobs.push(
+          relative === '' ? '^[\\s\\S]*$' : `^${relative}(?:${sep}[\\s\\S]*)?$`,
+        );
+        opts.includeDirs.push(resolved);
+      }
+    }
+  }
+
   return opts;
 }
 
+function toRegexSource(value) {
+  if (value instanceof RegExp) {
+    if (value.flags !== '') {
+      throw new Error(
+        `RegExp patterns must not have flags (got /${value.source}/${value.flags}). Flags are not supported by the native matcher.`,
+      );
+    }
+    // The native backend uses std::regex_match (full-string match), but
+    // callers expect JS .test() semantics (substring search). Wrapping the
+    // source in ^[\\s\\S]*(?:…)[\\s\\S]*$ achieves that. The (?:…) group
+    // isolates the source so leading/trailing | in the source stays contained.
+    return `^[\\s\\S]*(?:${value.source})[\\s\\S]*$`;
+  }
+
+  const regex = picomatch.makeRe(value, {
+    // We set `dot: true` to workaround an issue with the
+    // regular expression on Linux where the resulting
+    // negative lookahead `(?!(\\/|^)` was never matching
+    // in some cases. See also https://bit.ly/3UZlQDm
+    dot: true,
+    windows: process.platform === 'win32',
+  });
+  return regex.source;
+}
+
+function escapeRegex(value) {
+  return value.replace(/[.*+?^${}()|[\]\\/]/g, '\\$&');
+}
+
 exports.createWrapper = (binding) => {
   return {
     writeSnapshot(dir, snapshot, opts) {
@@ -69,10 +103,19 @@ exports.createWrapper = (binding) => {
     async subscribe(dir, fn, opts) {
       dir = path.resolve(dir);
       opts = normalizeOptions(dir, opts);
-      await binding.subscribe(dir, fn, opts);
+      const ready = binding.subscribe(dir, fn, opts);
+      if (opts.background) {
+        // Failures are reported through `ready`, which callers may not observe.
+        ready.catch(() => {});
+      } else {
+        await ready;
+      }
 
       return {
-        unsubscribe() {
+        ready,
+        async unsubscribe() {
+          // Unsubscribing before the subscription is ready would leave it behind.
+          await ready.catch(() => {});
           return binding.unsubscribe(dir, fn, opts);
         },
       };